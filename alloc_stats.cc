@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+// malloc interposition for the allocation accounting in alloc_stats.hh.
+// Every allocation function is forwarded to glibc's internal entry points and,
+// once enable_alloc_accounting() is called, accounted in per-thread counters;
+// block sizes come from malloc_usable_size() so free() doesn't need a header
+// of its own. Until then, the only cost is a call and a predictable branch.
+
+#include <malloc.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fstream>
+#include <string>
+#include "alloc_stats.hh"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+// Constant-initialized, so it's usable from malloc() before any constructor runs.
+static thread_local alloc_counters tls_heap_counters;
+
+// only written before other threads exist.
+static bool accounting_enabled = false;
+
+alloc_counters& thread_heap_counters() {
+    return tls_heap_counters;
+}
+
+void enable_alloc_accounting() {
+    accounting_enabled = true;
+}
+
+static void* note_alloc(void* p) {
+    if (accounting_enabled && p) {
+        thread_heap_counters().on_alloc(malloc_usable_size(p));
+    }
+    return p;
+}
+
+static void note_free(void* p) {
+    if (accounting_enabled && p) {
+        thread_heap_counters().on_free(malloc_usable_size(p));
+    }
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept {
+    return note_alloc(__libc_malloc(size));
+}
+
+void* calloc(size_t nmemb, size_t size) noexcept {
+    return note_alloc(__libc_calloc(nmemb, size));
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    if (!accounting_enabled) {
+        return __libc_realloc(ptr, size);
+    }
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    auto p = __libc_realloc(ptr, size);
+    if (p || !size) {
+        if (ptr) {
+            thread_heap_counters().on_free(old_size);
+        }
+        note_alloc(p);
+    }
+    return p;
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    return note_alloc(__libc_memalign(alignment, size));
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    return note_alloc(__libc_memalign(alignment, size));
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept {
+    if (alignment % sizeof(void*) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    auto p = note_alloc(__libc_memalign(alignment, size));
+    if (!p) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+void* valloc(size_t size) noexcept {
+    return note_alloc(__libc_memalign(sysconf(_SC_PAGESIZE), size));
+}
+
+void free(void* ptr) noexcept {
+    note_free(ptr);
+    __libc_free(ptr);
+}
+
+}
+
+static size_t proc_status_bytes(const std::string& field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, field.size(), field) == 0) {
+            return std::stoull(line.substr(field.size())) * 1024;
+        }
+    }
+    return 0;
+}
+
+size_t current_rss() {
+    return proc_status_bytes("VmRSS:");
+}
+
+size_t peak_rss() {
+    return proc_status_bytes("VmHWM:");
+}
+
+void reset_peak_rss() {
+    // Linux >= 4.0: writing 5 to clear_refs resets VmHWM to the current RSS.
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+struct alloc_counters {
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+    uint64_t bytes = 0;     // bytes allocated in total
+    int64_t live = 0;       // bytes currently allocated; may go negative if other threads free our memory
+    int64_t peak = 0;       // high watermark of live
+
+    void on_alloc(size_t s) {
+        allocs++;
+        bytes += s;
+        live += s;
+        peak = std::max(peak, live);
+    }
+    void on_free(size_t s) {
+        frees++;
+        live -= s;
+    }
+};
+
+// Heap activity of the calling thread, as seen by the malloc interposer in
+// alloc_stats.cc. It sees everything that goes through malloc(), including
+// operator new and codecs without allocation hooks.
+alloc_counters& thread_heap_counters();
+
+// The interposer counts nothing until this is called, so that modes which
+// don't report heap activity don't pay for it. Must be called before other
+// threads are started.
+void enable_alloc_accounting();
+
+// Resident set size of the process in bytes (VmRSS).
+size_t current_rss();
+
+// Peak resident set size of the process in bytes (VmHWM), and a way to reset
+// it to the current RSS, so the peak of a single phase can be measured.
+size_t peak_rss();
+void reset_peak_rss();
+
+// Heap activity of the calling thread from construction until done().
+// done().peak is the highest the thread's heap grew above its starting point.
+class alloc_probe {
+    alloc_counters& _c;
+    alloc_counters _start;
+public:
+    explicit alloc_probe(alloc_counters& c) : _c(c), _start(c) {
+        _c.peak = _c.live;
+    }
+    alloc_counters done() const {
+        alloc_counters r;
+        r.allocs = _c.allocs - _start.allocs;
+        r.frees = _c.frees - _start.frees;
+        r.bytes = _c.bytes - _start.bytes;
+        r.live = _c.live - _start.live;
+        r.peak = _c.peak - _start.live;
+        return r;
+    }
+};
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "temporary_buf.hh"
+
+// Bump-pointer arena for scratch memory whose lifetime is a batch of
+// operations (compressed outputs, headers, filter scratch). get() carves
+// buffers out of big blocks and the buffers don't free anything; reset()
+// makes all the memory available again in O(1) at the end of the batch.
+// Blocks are kept across resets, so once the arena has grown to the size of
+// a batch, further batches don't allocate at all.
+//
+// Buffers taken from the arena must not be used after reset(). As a
+// buf_resource, the arena hands out cache line aligned memory. Blocks are
+// allocated with block_policy, or from another buf_resource (e.g. a
+// numa_resource), so that a batch of small buffers can share huge pages or a
+// single NUMA binding.
+class arena : public buf_resource {
+    struct block {
+        char* p;
+        size_t size;
+        buf_deleter deleter;
+    };
+    std::vector<block> _blocks;
+    size_t _block_size;
+    alloc_policy _block_policy;
+    buf_resource* _block_source = nullptr;
+    size_t _current = 0;    // block being carved
+    size_t _offset = 0;     // first free byte in _blocks[_current]
+private:
+    void add_block(size_t min_size) {
+        auto size = std::max(_block_size, min_size);
+        buf_deleter d;
+        auto p = static_cast<char*>(_block_source ? _block_source->allocate(size, d)
+            : buf_alloc::allocate(size, _block_policy, d));
+        try {
+            _blocks.push_back(block{p, size, d});
+        } catch (...) {
+            d(p, size);
+            throw;
+        }
+    }
+
+    char* carve(size_t size, size_t alignment) {
+        while (true) {
+            if (_current == _blocks.size()) {
+                add_block(size + alignment);
+            }
+            auto& b = _blocks[_current];
+            auto offset = buf_alloc::align_up(_offset, alignment);
+            if (offset + size <= b.size) {
+                _offset = offset + size;
+                return b.p + offset;
+            }
+            _current++;
+            _offset = 0;
+        }
+    }
+public:
+    explicit arena(size_t block_size = 1024 * 1024, const alloc_policy& block_policy = alloc_policy::page_aligned())
+        : _block_size(block_size)
+        , _block_policy(block_policy) {}
+    arena(size_t block_size, buf_resource& block_source)
+        : _block_size(block_size)
+        , _block_source(&block_source) {}
+    arena(const arena&) = delete;
+    void operator=(const arena&) = delete;
+    ~arena() {
+        for (auto& b : _blocks) {
+            b.deleter(b.p, b.size);
+        }
+    }
+
+    temporary_buf<char> get(size_t size, size_t alignment = alloc_policy::cache_line_size) {
+        // the default buf_deleter doesn't free anything.
+        return temporary_buf<char>(carve(size, alignment), size, buf_deleter(), this);
+    }
+
+    void* allocate(size_t size, buf_deleter& d) override {
+        d = buf_deleter();
+        return carve(size, alloc_policy::cache_line_size);
+    }
+
+    void reset() {
+        _current = 0;
+        _offset = 0;
+    }
+
+    size_t capacity() const {
+        size_t ret = 0;
+        for (auto& b : _blocks) {
+            ret += b.size;
+        }
+        return ret;
+    }
+};
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include "temporary_buf.hh"
+
+// Pool of buffers for codec inputs and outputs, so that the
+// allocate/compress/free pattern of the benchmark (and of production code)
+// doesn't go to the allocator for every chunk.
+//
+// Sizes are rounded up to a power of two size class, from 4K to 16M; bigger
+// requests aren't pooled. Each thread caches up to max_cached_bytes of free
+// buffers per class, without any locking; buffers freed beyond that go back
+// to the heap. A buffer freed by another thread lands in that thread's cache,
+// and one freed while its thread exits goes back to the heap.
+//
+// get() returns a temporary_buf whose deleter gives the memory back to the
+// pool, so pooled buffers are used like any other. They are not zeroed.
+// resource() exposes the pool as a buf_resource.
+class buffer_pool {
+    static constexpr unsigned min_class_shift = 12;
+    static constexpr unsigned max_class_shift = 24;
+    static constexpr unsigned nr_classes = max_class_shift - min_class_shift + 1;
+    static constexpr size_t max_cached_bytes = 2 * 1024 * 1024;
+    static constexpr size_t min_cached_buffers = 2;
+public:
+    struct stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t unpooled = 0;
+    };
+private:
+    // trivially destructible, so it outlives the cache at thread exit.
+    static bool& cache_destroyed() {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    struct thread_cache {
+        std::array<std::vector<void*>, nr_classes> free;
+        buffer_pool::stats stats;
+
+        ~thread_cache() {
+            cache_destroyed() = true;
+            for (auto& list : free) {
+                for (auto p : list) {
+                    ::free(p);
+                }
+            }
+        }
+    };
+
+    // nullptr once the thread's cache is destroyed, as thread-local objects
+    // destroyed after it may still release buffers.
+    static thread_cache* cache() {
+        static thread_local thread_cache c;
+        return cache_destroyed() ? nullptr : &c;
+    }
+
+    static unsigned shift_of(size_t size) {
+        unsigned shift = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+        // not std::max(), which would odr-use the constant.
+        return shift < min_class_shift ? min_class_shift : shift;
+    }
+
+    static size_t max_cached(unsigned shift) {
+        auto n = max_cached_bytes >> shift;
+        return n < min_cached_buffers ? min_cached_buffers : n;
+    }
+
+    // Called from destructors, so it doesn't throw. Releasing on the thread
+    // that allocated doesn't allocate, as allocate() reserves the list; the
+    // first release into another thread's list of a class reserves it.
+    static void release(void* p, size_t size, void*) {
+        auto c = cache();
+        if (!c) {
+            ::free(p);
+            return;
+        }
+        auto shift = shift_of(size);
+        auto& list = c->free[shift - min_class_shift];
+        try {
+            list.reserve(max_cached(shift));
+        } catch (...) {
+            ::free(p);
+            return;
+        }
+        if (list.size() < max_cached(shift)) {
+            list.push_back(p);
+        } else {
+            ::free(p);
+        }
+    }
+
+    static void* allocate(size_t size, buf_deleter& d) {
+        auto c = cache();
+        auto shift = shift_of(size);
+        if (!c || shift > max_class_shift) {
+            if (c) {
+                c->stats.unpooled++;
+            }
+            return buf_alloc::allocate(size, alloc_policy::heap(), d);
+        }
+
+        auto& list = c->free[shift - min_class_shift];
+        void* p;
+        if (!list.empty()) {
+            c->stats.hits++;
+            p = list.back();
+            list.pop_back();
+        } else {
+            c->stats.misses++;
+            list.reserve(max_cached(shift));
+            if (posix_memalign(&p, alloc_policy::cache_line_size, size_t(1) << shift)) {
+                throw std::bad_alloc();
+            }
+        }
+        d.free = release;
+        return p;
+    }
+
+    struct pool_resource : public buf_resource {
+        void* allocate(size_t size, buf_deleter& d) override {
+            return buffer_pool::allocate(size, d);
+        }
+    };
+public:
+    static buf_resource& resource() {
+        static pool_resource r;
+        return r;
+    }
+
+    static temporary_buf<char> get(size_t size) {
+        return temporary_buf<char>(size, uninitialized, resource());
+    }
+
+    // hits, misses and unpooled requests of the calling thread.
+    static stats thread_stats() {
+        auto c = cache();
+        return c ? c->stats : stats();
+    }
+};
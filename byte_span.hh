@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include "temporary_buf.hh"
+
+// Non-owning view of a range of bytes, for passing codec inputs and outputs
+// and sub-ranges of big (e.g. mapped) buffers without creating owning
+// buffers. byte_span is read-only, mutable_byte_span is writable and converts
+// to byte_span. Slicing is bounds checked.
+template <typename T>
+class basic_byte_span {
+    static_assert(sizeof(T) == 1, "must be stream of bytes");
+    T* _p = nullptr;
+    size_t _s = 0;
+public:
+    static constexpr size_t npos = size_t(-1);
+
+    basic_byte_span() = default;
+    basic_byte_span(T* p, size_t s) : _p(p), _s(s) {}
+    // mutable_byte_span to byte_span.
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    basic_byte_span(basic_byte_span<U> other) : _p(other.data()), _s(other.size()) {}
+    basic_byte_span(temporary_buf<typename std::remove_const<T>::type>& buf) : _p(buf.get()), _s(buf.size()) {}
+    template <typename U = T, typename = typename std::enable_if<std::is_const<U>::value>::type>
+    basic_byte_span(const temporary_buf<typename std::remove_const<T>::type>& buf) : _p(buf.get()), _s(buf.size()) {}
+
+    T* data() const {
+        return _p;
+    }
+    size_t size() const {
+        return _s;
+    }
+    bool empty() const {
+        return !_s;
+    }
+    T* begin() const {
+        return _p;
+    }
+    T* end() const {
+        return _p + _s;
+    }
+
+    // len bytes starting at offset, or everything after offset.
+    basic_byte_span subspan(size_t offset, size_t len = npos) const {
+        if (offset > _s) {
+            throw std::out_of_range("byte span slice past the end");
+        }
+        return basic_byte_span(_p + offset, std::min(len, _s - offset));
+    }
+    basic_byte_span first(size_t len) const {
+        if (len > _s) {
+            throw std::out_of_range("byte span slice past the end");
+        }
+        return basic_byte_span(_p, len);
+    }
+};
+
+using byte_span = basic_byte_span<const char>;
+using mutable_byte_span = basic_byte_span<char>;
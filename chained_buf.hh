@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <vector>
+#include "temporary_buf.hh"
+
+// Concatenation of temporary_bufs that doesn't copy them: the buffers are kept
+// as fragments, in order, and appending moves a buffer in. Used to build a
+// stream of compressed chunks without copying every byte once more, as
+// operator+ on temporary_bufs does.
+//
+// Fragments can be iterated for scatter/gather consumers. A contiguous copy is
+// only made on demand, by linearize().
+class chained_buf {
+    std::vector<temporary_buf<char>> _fragments;
+    size_t _size = 0;
+public:
+    chained_buf() = default;
+    chained_buf(chained_buf&&) = default;
+    chained_buf& operator=(chained_buf&&) = default;
+    explicit chained_buf(temporary_buf<char>&& buf) {
+        append(std::move(buf));
+    }
+
+    void append(temporary_buf<char>&& buf) {
+        _size += buf.size();
+        _fragments.push_back(std::move(buf));
+    }
+    void append(chained_buf&& other) {
+        for (auto& f : other._fragments) {
+            append(std::move(f));
+        }
+        other.clear();
+    }
+    void clear() {
+        _fragments.clear();
+        _size = 0;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+    size_t nr_fragments() const {
+        return _fragments.size();
+    }
+    std::vector<temporary_buf<char>>::const_iterator begin() const {
+        return _fragments.begin();
+    }
+    std::vector<temporary_buf<char>>::const_iterator end() const {
+        return _fragments.end();
+    }
+
+    // Copies len bytes starting at offset into dest, across fragments.
+    void copy_out(size_t offset, size_t len, char* dest) const {
+        if (offset + len > _size) {
+            throw std::out_of_range("chained_buf::copy_out() past the end");
+        }
+        for (auto& f : _fragments) {
+            if (!len) {
+                break;
+            }
+            if (offset >= f.size()) {
+                offset -= f.size();
+                continue;
+            }
+            auto n = std::min(len, f.size() - offset);
+            memcpy(dest, f.get() + offset, n);
+            dest += n;
+            len -= n;
+            offset = 0;
+        }
+    }
+
+    // Contiguous copy of the whole chain, from the resource of the first
+    // fragment.
+    temporary_buf<char> linearize() const {
+        auto& r = _fragments.empty() ? default_resource() : _fragments.front().resource();
+        auto buf = temporary_buf<char>(_size, uninitialized, r);
+        copy_out(0, _size, buf.get());
+        return buf;
+    }
+
+    // Replaces the fragments with a single contiguous one, which is returned.
+    // Doesn't copy if there is a single fragment already.
+    const temporary_buf<char>& linearize_in_place() {
+        if (_fragments.size() != 1) {
+            auto buf = linearize();
+            clear();
+            append(std::move(buf));
+        }
+        return _fragments.front();
+    }
+};
+
+static inline chained_buf operator+(chained_buf&& a, temporary_buf<char>&& b) {
+    a.append(std::move(b));
+    return std::move(a);
+}
@@ -0,0 +1,923 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <boost/format.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "temporary_buf.hh"
+#include "byte_span.hh"
+#include "chained_buf.hh"
+#include "compressors.hh"
+#include "elias_fano.hh"
+#include "io_backend.hh"
+#include "mapped_buf.hh"
+
+// Compressed file made of fixed-size chunks, each compressed on its own, like
+// the data and compression info of an SSTable: any uncompressed offset can be
+// read by uncompressing a single chunk.
+//
+// On-disk layout, integers in host byte order:
+//
+//     compressed chunks, back to back
+//     index:
+//         codec name length (u8), codec name, level (i32)
+//         chunk length (u32), uncompressed data length (u64), number of chunks (u64)
+//         per chunk: offset of its compressed data (u64), crc32 of it (u32)
+//     trailer: offset of the index (u64), magic (u64)
+//
+// The compressed length of a chunk is the distance to the next chunk, or to
+// the index for the last one. In memory, offsets are kept Elias-Fano encoded,
+// so that readers of huge files with small chunks don't spend 8 bytes per
+// chunk on them.
+
+// How chunks go to and come from the disk.
+enum class file_access {
+    buffered,   // through the page cache
+    direct,     // O_DIRECT, bypassing the page cache: aligned transfers only
+};
+
+// offset, length and memory alignment of O_DIRECT transfers. Block devices
+// may get away with 512, but 4K is safe everywhere.
+static constexpr size_t direct_io_alignment = alloc_policy::page_size;
+
+// RAII file descriptor, with pread/pwrite that retry interrupted transfers.
+class file_desc {
+    int _fd = -1;
+    std::string _path;
+private:
+    [[noreturn]] void fail(const char* what) const {
+        throw std::runtime_error(std::string(what) + " " + _path + ": " + strerror(errno));
+    }
+public:
+    file_desc(const std::string& path, int flags, mode_t mode = 0644) : _path(path) {
+        _fd = ::open(path.c_str(), flags, mode);
+        if (_fd < 0) {
+            fail("cannot open");
+        }
+    }
+    file_desc(file_desc&& other) : _fd(other._fd), _path(std::move(other._path)) {
+        other._fd = -1;
+    }
+    file_desc(const file_desc&) = delete;
+    void operator=(const file_desc&) = delete;
+    ~file_desc() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    int fd() const {
+        return _fd;
+    }
+    const std::string& path() const {
+        return _path;
+    }
+    uint64_t size() const {
+        struct stat st;
+        if (::fstat(_fd, &st) < 0) {
+            fail("cannot stat");
+        }
+        return st.st_size;
+    }
+
+    // reads up to len bytes, less only at end of file.
+    size_t pread(char* buf, size_t len, uint64_t pos) const {
+        size_t done = 0;
+        while (done < len) {
+            auto r = pread_once(buf + done, len - done, pos + done);
+            if (!r) {
+                break;
+            }
+            done += r;
+        }
+        return done;
+    }
+    // A single read, which may be short anywhere. For O_DIRECT, where
+    // reading the rest at an unaligned position would fail.
+    size_t pread_once(char* buf, size_t len, uint64_t pos) const {
+        while (true) {
+            auto r = ::pread(_fd, buf, len, pos);
+            if (r >= 0) {
+                return r;
+            }
+            if (errno != EINTR) {
+                fail("cannot read");
+            }
+        }
+    }
+    void pwrite(const char* buf, size_t len, uint64_t pos) {
+        size_t done = 0;
+        while (done < len) {
+            auto r = ::pwrite(_fd, buf + done, len - done, pos + done);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail("cannot write");
+            }
+            done += r;
+        }
+    }
+    void truncate(uint64_t len) {
+        if (::ftruncate(_fd, len) < 0) {
+            fail("cannot truncate");
+        }
+    }
+};
+
+struct compression_info {
+    static constexpr uint64_t magic = 0x3158444e4b4e4843;     // "CHNKNDX1"
+    // chunk lengths are stored in 32 bits.
+    static constexpr uint64_t max_chunk_len = UINT32_MAX;
+
+    std::string codec;
+    int32_t level = 0;
+    uint32_t chunk_len = 0;
+    uint64_t data_len = 0;
+    // of each chunk, followed by the offset of the index.
+    elias_fano offsets;
+    std::vector<uint32_t> checksums;
+
+    static uint32_t checked_chunk_len(uint64_t len) {
+        if (!len || len > max_chunk_len) {
+            throw std::runtime_error((boost::format("chunk length must be between 1 and %1%, not %2%")
+                % uint64_t(max_chunk_len) % len).str());
+        }
+        return len;
+    }
+
+    size_t nr_chunks() const {
+        return checksums.size();
+    }
+    uint64_t chunk_offset(size_t i) const {
+        return offsets[i];
+    }
+    size_t chunk_compressed_len(size_t i) const {
+        auto range = offsets.pair_at(i);
+        return range.second - range.first;
+    }
+    // the last chunk may be short.
+    size_t chunk_uncompressed_len(size_t i) const {
+        return std::min<uint64_t>(chunk_len, data_len - uint64_t(i) * chunk_len);
+    }
+};
+
+static inline uint32_t chunk_checksum(byte_span data) {
+    return ::crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size());
+}
+
+namespace chunked_file_format {
+
+template <typename T>
+static inline void put(std::vector<char>& out, T v) {
+    auto p = reinterpret_cast<const char*>(&v);
+    out.insert(out.end(), p, p + sizeof(v));
+}
+
+template <typename T>
+static inline T get(byte_span& in) {
+    if (in.size() < sizeof(T)) {
+        throw std::runtime_error("truncated chunked file index");
+    }
+    T v;
+    memcpy(&v, in.data(), sizeof(v));
+    in = in.subspan(sizeof(v));
+    return v;
+}
+
+static inline std::vector<char> serialize_index(const compression_info& info, const std::vector<uint64_t>& offsets) {
+    std::vector<char> out;
+    put<uint8_t>(out, info.codec.size());
+    out.insert(out.end(), info.codec.begin(), info.codec.end());
+    put<int32_t>(out, info.level);
+    put<uint32_t>(out, info.chunk_len);
+    put<uint64_t>(out, info.data_len);
+    put<uint64_t>(out, info.nr_chunks());
+    for (size_t i = 0; i < info.nr_chunks(); i++) {
+        put<uint64_t>(out, offsets[i]);
+        put<uint32_t>(out, info.checksums[i]);
+    }
+    return out;
+}
+
+static inline compression_info deserialize_index(byte_span in, uint64_t index_offset) {
+    compression_info info;
+    auto codec_len = get<uint8_t>(in);
+    if (in.size() < codec_len) {
+        throw std::runtime_error("truncated chunked file index");
+    }
+    info.codec.assign(in.data(), codec_len);
+    in = in.subspan(codec_len);
+    info.level = get<int32_t>(in);
+    info.chunk_len = get<uint32_t>(in);
+    info.data_len = get<uint64_t>(in);
+    auto nr_chunks = get<uint64_t>(in);
+    if (!info.chunk_len || nr_chunks != (info.data_len + info.chunk_len - 1) / info.chunk_len) {
+        throw std::runtime_error("corrupt chunked file index");
+    }
+    std::vector<uint64_t> offsets;
+    offsets.reserve(nr_chunks + 1);
+    info.checksums.reserve(nr_chunks);
+    for (uint64_t i = 0; i < nr_chunks; i++) {
+        offsets.push_back(get<uint64_t>(in));
+        info.checksums.push_back(get<uint32_t>(in));
+    }
+    offsets.push_back(index_offset);
+    info.offsets = elias_fano(offsets);
+    return info;
+}
+
+}
+
+// Splits whatever is written into chunks of chunk_len bytes and appends them,
+// compressed, to the file. close() writes the index; a file that wasn't
+// closed can't be read.
+//
+// With an io_backend, chunks are compressed into io->depth() rotating buffers
+// and their writes left in flight while the next chunks are compressed; with
+// io_uring that also batches the writes of many chunks into one syscall.
+// The backend must not be used for anything else until close().
+//
+// With file_access::direct, compressed chunks, and then the index, are packed
+// back to back into an aligned write unit, which is written with O_DIRECT
+// each time it fills up. The last unit is padded to the alignment, and the
+// file truncated back to its real length.
+class chunked_writer {
+    static constexpr size_t direct_write_unit = 1024 * 1024;
+
+    file_desc _file;
+    std::unique_ptr<compressor> _compressor;
+    compression_info _info;
+    // plain until close(), when they're encoded into _info.
+    std::vector<uint64_t> _offsets;
+    temporary_buf<char> _pending;
+    size_t _pending_len = 0;
+    temporary_buf<char> _compressed;
+    uint64_t _pos = 0;
+    bool _closed = false;
+    io_backend* _io;
+    std::vector<temporary_buf<char>> _write_bufs;
+    std::vector<size_t> _write_lens;
+    std::vector<size_t> _free_bufs;
+    std::vector<io_completion> _completions;
+    bool _direct;
+    temporary_buf<char> _unit;
+    size_t _unit_len = 0;
+    uint64_t _unit_pos = 0;
+private:
+    // before the file is opened, which truncates it.
+    static const std::string& checked_path(const std::string& path, size_t chunk_len, io_backend* io,
+            file_access access) {
+        compression_info::checked_chunk_len(chunk_len);
+        if (io && access == file_access::direct) {
+            throw std::runtime_error("direct writes are packed into write units and don't take an I/O backend");
+        }
+        return path;
+    }
+
+    void append_direct(byte_span data) {
+        while (!data.empty()) {
+            auto n = std::min(data.size(), _unit.size() - _unit_len);
+            memcpy(_unit.get() + _unit_len, data.data(), n);
+            _unit_len += n;
+            data = data.subspan(n);
+            if (_unit_len == _unit.size()) {
+                _file.pwrite(_unit.get(), _unit.size(), _unit_pos);
+                _unit_pos += _unit.size();
+                _unit_len = 0;
+            }
+        }
+    }
+
+    void finish_direct() {
+        auto len = buf_alloc::align_up(_unit_len, direct_io_alignment);
+        memset(_unit.get() + _unit_len, 0, len - _unit_len);
+        _file.pwrite(_unit.get(), len, _unit_pos);
+        _file.truncate(_unit_pos + _unit_len);
+    }
+
+    void complete_writes(size_t min) {
+        _completions.clear();
+        _io->wait(min, _completions);
+        for (auto& c : _completions) {
+            if (c.result != int64_t(_write_lens[c.tag])) {
+                errno = c.result < 0 ? -c.result : EIO;
+                throw std::runtime_error(std::string("cannot write ") + _file.path() + ": " + strerror(errno));
+            }
+            _free_bufs.push_back(c.tag);
+        }
+    }
+
+    void flush_chunk(byte_span chunk) {
+        if (!_io) {
+            auto len = _compressor->compress(chunk, _compressed);
+            auto compressed = byte_span(_compressed).first(len);
+            if (_direct) {
+                append_direct(compressed);
+            } else {
+                _file.pwrite(compressed.data(), compressed.size(), _pos);
+            }
+            _offsets.push_back(_pos);
+            _info.checksums.push_back(chunk_checksum(compressed));
+            _info.data_len += chunk.size();
+            _pos += len;
+            return;
+        }
+        if (_free_bufs.empty()) {
+            complete_writes(1);
+        }
+        auto b = _free_bufs.back();
+        _free_bufs.pop_back();
+        auto len = _compressor->compress(chunk, _write_bufs[b]);
+        auto compressed = byte_span(_write_bufs[b]).first(len);
+        io_request r;
+        r.write = true;
+        r.fd = _file.fd();
+        r.buf = _write_bufs[b].get();
+        r.len = len;
+        r.pos = _pos;
+        r.tag = b;
+        _write_lens[b] = len;
+        _io->submit(r);
+        _offsets.push_back(_pos);
+        _info.checksums.push_back(chunk_checksum(compressed));
+        _info.data_len += chunk.size();
+        _pos += len;
+    }
+public:
+    chunked_writer(const std::string& path, std::unique_ptr<compressor> c, size_t chunk_len, io_backend* io = nullptr,
+            file_access access = file_access::buffered)
+        : _file(checked_path(path, chunk_len, io, access),
+            O_WRONLY | O_CREAT | O_TRUNC | (access == file_access::direct ? O_DIRECT : 0))
+        , _compressor(std::move(c))
+        , _pending(chunk_len, uninitialized)
+        , _compressed(_compressor->compress_max_size(chunk_len), uninitialized)
+        , _io(io)
+        , _direct(access == file_access::direct)
+        , _unit(_direct ? direct_write_unit : 0, uninitialized, alloc_policy::page_aligned()) {
+        _info.codec = _compressor->name();
+        _info.level = _compressor->level();
+        _info.chunk_len = chunk_len;
+        if (_io) {
+            // without a buffer, flush_chunk() would have nothing to write from.
+            assert(_io->depth() > 0);
+            _write_bufs.reserve(_io->depth());
+            for (size_t b = 0; b < _io->depth(); b++) {
+                _write_bufs.emplace_back(_compressed.size(), uninitialized);
+                _free_bufs.push_back(b);
+            }
+            _write_lens.resize(_io->depth());
+        }
+    }
+    chunked_writer(const chunked_writer&) = delete;
+    void operator=(const chunked_writer&) = delete;
+    ~chunked_writer() {
+        // the kernel may still be reading the buffers.
+        if (_io && _io->in_flight()) {
+            _completions.clear();
+            _io->drain(_completions);
+        }
+    }
+
+    void write(byte_span data) {
+        // whole chunks are compressed straight from data.
+        while (!data.empty()) {
+            if (!_pending_len && data.size() >= _info.chunk_len) {
+                flush_chunk(data.first(_info.chunk_len));
+                data = data.subspan(_info.chunk_len);
+                continue;
+            }
+            auto n = std::min(data.size(), _info.chunk_len - _pending_len);
+            memcpy(_pending.get() + _pending_len, data.data(), n);
+            _pending_len += n;
+            data = data.subspan(n);
+            if (_pending_len == _info.chunk_len) {
+                flush_chunk(_pending);
+                _pending_len = 0;
+            }
+        }
+    }
+
+    // Whole chunks within a fragment are compressed straight from it, so only
+    // chunks straddling fragments are copied.
+    void write(const chained_buf& data) {
+        for (auto& fragment : data) {
+            write(byte_span(fragment));
+        }
+    }
+
+    void close() {
+        if (_closed) {
+            return;
+        }
+        if (_pending_len) {
+            flush_chunk(byte_span(_pending).first(_pending_len));
+            _pending_len = 0;
+        }
+        if (_io) {
+            complete_writes(_io->in_flight());
+        }
+        auto index = chunked_file_format::serialize_index(_info, _offsets);
+        chunked_file_format::put<uint64_t>(index, _pos);
+        chunked_file_format::put<uint64_t>(index, compression_info::magic);
+        if (_direct) {
+            append_direct(byte_span(index.data(), index.size()));
+            finish_direct();
+        } else {
+            _file.pwrite(index.data(), index.size(), _pos);
+        }
+        _offsets.push_back(_pos);
+        _info.offsets = elias_fano(_offsets);
+        _offsets = {};
+        _closed = true;
+    }
+
+    // offsets are only there after close().
+    const compression_info& info() const {
+        return _info;
+    }
+    // compressed bytes written so far, index excluded.
+    uint64_t compressed_size() const {
+        return _pos;
+    }
+};
+
+// With file_access::direct, the index is still read through the page cache,
+// but chunks are read with O_DIRECT: the aligned span covering a chunk, or a
+// window of chunks, is read into a page aligned buffer and chunks are
+// uncompressed from offsets into it.
+class chunked_reader {
+    static constexpr size_t direct_read_window = 1024 * 1024;
+
+    // where a chunk is read from, and where it starts in what's read.
+    struct read_span {
+        uint64_t pos;
+        size_t len;
+        size_t skip;
+    };
+
+    file_desc _file;
+    std::unique_ptr<file_desc> _direct_file;
+    compression_info _info;
+    std::unique_ptr<compressor> _compressor;
+    temporary_buf<char> _compressed;
+    temporary_buf<char> _chunk;
+public:
+    // reads the index of a chunked file.
+    static compression_info load_info(const file_desc& f) {
+        static constexpr size_t trailer_len = 2 * sizeof(uint64_t);
+        auto file_size = f.size();
+        uint64_t trailer[2];
+        if (file_size < trailer_len
+                || f.pread(reinterpret_cast<char*>(trailer), trailer_len, file_size - trailer_len) != trailer_len
+                || trailer[1] != compression_info::magic
+                || trailer[0] > file_size - trailer_len) {
+            throw std::runtime_error(f.path() + " is not a chunked compressed file");
+        }
+        auto index_offset = trailer[0];
+        auto index = temporary_buf<char>(file_size - trailer_len - index_offset, uninitialized);
+        f.pread(index.get(), index.size(), index_offset);
+        return chunked_file_format::deserialize_index(index, index_offset);
+    }
+private:
+
+    static size_t max_compressed_len(const compression_info& info) {
+        size_t ret = 0;
+        for (size_t i = 0; i < info.nr_chunks(); i++) {
+            ret = std::max(ret, info.chunk_compressed_len(i));
+        }
+        return ret;
+    }
+
+    size_t uncompress_chunk(compressor& c, size_t i, byte_span compressed, mutable_byte_span out) const {
+        if (chunk_checksum(compressed) != _info.checksums[i]) {
+            throw std::runtime_error((boost::format("%1%: checksum mismatch in chunk %2%") % _file.path() % i).str());
+        }
+        auto s = c.uncompress(compressed, out.first(_info.chunk_len));
+        if (s != _info.chunk_uncompressed_len(i)) {
+            throw std::runtime_error((boost::format("%1%: chunk %2% has the wrong length") % _file.path() % i).str());
+        }
+        return s;
+    }
+
+    read_span span_of(size_t i) const {
+        auto pos = _info.chunk_offset(i);
+        auto len = _info.chunk_compressed_len(i);
+        if (!_direct_file) {
+            return read_span{pos, len, 0};
+        }
+        auto start = pos & ~uint64_t(direct_io_alignment - 1);
+        return read_span{start, buf_alloc::align_up(pos + len, direct_io_alignment) - start, pos - start};
+    }
+
+    // Chunks [first, end) and the span read for them in one request by
+    // for_each_chunk(). Buffered, that's a chunk. With O_DIRECT, neighbouring
+    // chunks share their boundary pages, and small chunks would have their
+    // pages read from the disk several times, so a window of about
+    // direct_read_window aligned bytes is read at once instead.
+    struct read_unit {
+        size_t first;
+        size_t end;
+        uint64_t pos;
+        size_t len;
+    };
+
+    read_unit unit_at(size_t first) const {
+        auto span = span_of(first);
+        read_unit u{first, first + 1, span.pos, span.len};
+        if (!_direct_file) {
+            return u;
+        }
+        for (; u.end < _info.nr_chunks(); u.end++) {
+            auto end = buf_alloc::align_up(_info.chunk_offset(u.end + 1), direct_io_alignment);
+            if (end - u.pos > direct_read_window) {
+                break;
+            }
+            u.len = end - u.pos;
+        }
+        return u;
+    }
+
+    const file_desc& chunk_file() const {
+        return _direct_file ? *_direct_file : _file;
+    }
+
+    // room for any chunk, and the alignment slack of direct reads.
+    size_t read_buf_len() const {
+        return max_compressed_len(_info) + (_direct_file ? 2 * direct_io_alignment : 0);
+    }
+
+    // room for any read_unit.
+    size_t unit_buf_len() const {
+        auto len = read_buf_len();
+        return _direct_file && len < direct_read_window ? direct_read_window : len;
+    }
+
+    [[noreturn]] void truncated(size_t i) const {
+        throw std::runtime_error((boost::format("%1%: chunk %2% is truncated") % _file.path() % i).str());
+    }
+
+    void submit_read(io_backend& io, const read_unit& u, temporary_buf<char>& buf, size_t tag) const {
+        io_request r;
+        r.fd = chunk_file().fd();
+        r.buf = buf.get();
+        r.len = u.len;
+        r.pos = u.pos;
+        r.tag = tag;
+        io.submit(r);
+    }
+
+    // the compressed chunk i of unit u, read into buf.
+    byte_span chunk_in(const read_unit& u, size_t i, const io_completion& c, const temporary_buf<char>& buf) const {
+        auto skip = _info.chunk_offset(i) - u.pos;
+        auto len = _info.chunk_compressed_len(i);
+        if (c.result < int64_t(skip + len)) {
+            truncated(i);
+        }
+        return byte_span(buf).subspan(skip, len);
+    }
+
+    template <typename Func>
+    void for_each_chunk_on_workers(io_backend& io, std::vector<temporary_buf<char>>& bufs, Func& f, unsigned workers) {
+        struct read_chunk {
+            size_t i;
+            size_t buf;
+            byte_span compressed;
+        };
+        auto nr_chunks = _info.nr_chunks();
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable buf_freed;
+        std::vector<read_chunk> ready;
+        std::vector<size_t> free_bufs;
+        for (size_t b = 0; b < bufs.size(); b++) {
+            free_bufs.push_back(b);
+        }
+        // chunks of each buffer not uncompressed yet.
+        std::vector<size_t> pending(bufs.size());
+        bool reads_done = false;
+        std::exception_ptr error;
+        auto fail = [&] (std::exception_ptr e) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = e;
+            }
+            work_ready.notify_all();
+            buf_freed.notify_all();
+        };
+
+        std::vector<std::thread> threads;
+        auto join = [&] {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                reads_done = true;
+            }
+            work_ready.notify_all();
+            for (auto& t : threads) {
+                t.join();
+            }
+        };
+        try {
+            for (unsigned w = 0; w < workers; w++) {
+                threads.emplace_back([&] {
+                    try {
+                        auto c = make_compressor(compressor_type_from_name(_info.codec));
+                        auto chunk = temporary_buf<char>(_info.chunk_len, uninitialized);
+                        while (true) {
+                            read_chunk r;
+                            {
+                                std::unique_lock<std::mutex> lock(mutex);
+                                work_ready.wait(lock, [&] { return !ready.empty() || reads_done || error; });
+                                if (error || ready.empty()) {
+                                    return;
+                                }
+                                r = ready.back();
+                                ready.pop_back();
+                            }
+                            auto s = uncompress_chunk(*c, r.i, r.compressed, chunk);
+                            f(r.i, byte_span(chunk).first(s));
+                            bool freed;
+                            {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                freed = !--pending[r.buf];
+                                if (freed) {
+                                    free_bufs.push_back(r.buf);
+                                }
+                            }
+                            if (freed) {
+                                buf_freed.notify_one();
+                            }
+                        }
+                    } catch (...) {
+                        fail(std::current_exception());
+                    }
+                });
+            }
+
+            std::vector<read_unit> unit_of(bufs.size());
+            std::vector<io_completion> done;
+            size_t next = 0;
+            size_t completed = 0;
+            while (completed < nr_chunks) {
+                std::vector<size_t> to_submit;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    // with nothing in flight, only a worker can free a buffer.
+                    buf_freed.wait(lock, [&] { return !free_bufs.empty() || io.in_flight() || error; });
+                    if (error) {
+                        break;
+                    }
+                    while (!free_bufs.empty() && io.in_flight() + to_submit.size() < io.depth()) {
+                        to_submit.push_back(free_bufs.back());
+                        free_bufs.pop_back();
+                    }
+                }
+                for (auto b : to_submit) {
+                    if (next < nr_chunks) {
+                        unit_of[b] = unit_at(next);
+                        next = unit_of[b].end;
+                        submit_read(io, unit_of[b], bufs[b], b);
+                    } else {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        free_bufs.push_back(b);
+                    }
+                }
+                done.clear();
+                io.wait(1, done);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (auto& c : done) {
+                        auto& u = unit_of[c.tag];
+                        pending[c.tag] = u.end - u.first;
+                        for (auto i = u.first; i < u.end; i++) {
+                            ready.push_back(read_chunk{i, c.tag, chunk_in(u, i, c, bufs[c.tag])});
+                        }
+                        completed += u.end - u.first;
+                    }
+                }
+                work_ready.notify_all();
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        if (io.in_flight()) {
+            // the kernel may still be writing to the buffers.
+            std::vector<io_completion> done;
+            io.drain(done);
+        }
+        join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+public:
+    explicit chunked_reader(const std::string& path, file_access access = file_access::buffered)
+        : _file(path, O_RDONLY)
+        , _direct_file(access == file_access::direct ? std::make_unique<file_desc>(path, O_RDONLY | O_DIRECT) : nullptr)
+        , _info(load_info(_file))
+        , _compressor(make_compressor(compressor_type_from_name(_info.codec)))
+        , _compressed(read_buf_len(), uninitialized, alloc_policy::page_aligned())
+        , _chunk(_info.chunk_len, uninitialized) {
+    }
+
+    const compression_info& info() const {
+        return _info;
+    }
+    uint64_t size() const {
+        return _info.data_len;
+    }
+
+    // Uncompresses chunk i into out, which must have room for chunk_len bytes,
+    // after checking its checksum. Returns the uncompressed length.
+    size_t read_chunk(size_t i, mutable_byte_span out) {
+        if (i >= _info.nr_chunks()) {
+            throw std::out_of_range("chunk index past the end");
+        }
+        auto len = _info.chunk_compressed_len(i);
+        auto span = span_of(i);
+        // a short O_DIRECT read isn't retried, at an unaligned position.
+        auto n = _direct_file ? _direct_file->pread_once(_compressed.get(), span.len, span.pos)
+            : _file.pread(_compressed.get(), span.len, span.pos);
+        if (n < span.skip + len) {
+            truncated(i);
+        }
+        return uncompress_chunk(*_compressor, i, byte_span(_compressed).subspan(span.skip, len), out);
+    }
+
+    // Reads and uncompresses every chunk, keeping up to io.depth() reads in
+    // flight so that the uncompression of a chunk overlaps with the reads of
+    // the next ones. f(i, data) is called with each uncompressed chunk as its
+    // read completes, which may be out of order. With O_DIRECT, each read
+    // covers a window of chunks (see read_unit).
+    //
+    // With workers > 0, the calling thread only submits reads and hands the
+    // completed ones to that many threads, each uncompressing with a
+    // compressor of its own, so reads overlap with as many uncompressions.
+    // f is then called from the workers, concurrently.
+    template <typename Func>
+    void for_each_chunk(io_backend& io, Func f, unsigned workers = 0) {
+        // without a buffer, no read would ever be submitted.
+        assert(io.depth() > 0);
+        auto nr_chunks = _info.nr_chunks();
+        // each worker holds a buffer while uncompressing, on top of the reads.
+        auto depth = std::min(io.depth() + workers, nr_chunks);
+        std::vector<temporary_buf<char>> bufs;
+        bufs.reserve(depth);
+        for (size_t b = 0; b < depth; b++) {
+            bufs.emplace_back(unit_buf_len(), uninitialized, alloc_policy::page_aligned());
+        }
+        if (workers) {
+            for_each_chunk_on_workers(io, bufs, f, workers);
+            return;
+        }
+        std::vector<size_t> free_bufs;
+        for (size_t b = 0; b < bufs.size(); b++) {
+            free_bufs.push_back(b);
+        }
+        std::vector<read_unit> unit_of(bufs.size());
+        std::vector<io_completion> done;
+        try {
+            size_t next = 0;
+            size_t completed = 0;
+            while (completed < nr_chunks) {
+                while (next < nr_chunks && !free_bufs.empty() && io.in_flight() < io.depth()) {
+                    auto b = free_bufs.back();
+                    free_bufs.pop_back();
+                    unit_of[b] = unit_at(next);
+                    next = unit_of[b].end;
+                    submit_read(io, unit_of[b], bufs[b], b);
+                }
+                done.clear();
+                io.wait(1, done);
+                for (auto& c : done) {
+                    auto& u = unit_of[c.tag];
+                    for (auto i = u.first; i < u.end; i++) {
+                        auto s = uncompress_chunk(*_compressor, i, chunk_in(u, i, c, bufs[c.tag]), _chunk);
+                        f(i, byte_span(_chunk).first(s));
+                    }
+                    free_bufs.push_back(c.tag);
+                    completed += u.end - u.first;
+                }
+            }
+        } catch (...) {
+            // the kernel may still be writing to the buffers.
+            done.clear();
+            io.drain(done);
+            throw;
+        }
+    }
+
+    // Reads out.size() bytes at uncompressed offset pos, fewer at the end of
+    // the data, uncompressing each chunk covered once. Returns bytes read.
+    size_t read(uint64_t pos, mutable_byte_span out) {
+        size_t done = 0;
+        while (done < out.size() && pos < _info.data_len) {
+            auto i = pos / _info.chunk_len;
+            auto in_chunk = pos % _info.chunk_len;
+            auto n = std::min<uint64_t>(out.size() - done, _info.chunk_uncompressed_len(i) - in_chunk);
+            if (!in_chunk && n == _info.chunk_len) {
+                // whole chunk, uncompressed in place.
+                read_chunk(i, out.subspan(done, n));
+            } else {
+                read_chunk(i, _chunk);
+                memcpy(out.data() + done, _chunk.get() + in_chunk, n);
+            }
+            done += n;
+            pos += n;
+        }
+        return done;
+    }
+};
+
+// Compresses input into a chunked file without any intermediate buffer: the
+// input is mapped, and each chunk is compressed straight from the mapping
+// into a mapping of the output file, preallocated for the worst case and
+// truncated at the end. Input pages are dropped once compressed, so files
+// bigger than memory stream through. Returns the compressed size.
+static inline uint64_t compress_file_mapped(const std::string& input, const std::string& output, compressor& c,
+        size_t chunk_len) {
+    compression_info::checked_chunk_len(chunk_len);
+    auto in = map_file(input, access_hint::sequential);
+    uint64_t nr_chunks = (in.size() + chunk_len - 1) / chunk_len;
+    compression_info info;
+    info.codec = c.name();
+    info.level = c.level();
+    info.chunk_len = chunk_len;
+    info.data_len = in.size();
+    info.checksums.reserve(nr_chunks);
+    std::vector<uint64_t> offsets;
+    offsets.reserve(nr_chunks);
+
+    // codec name and fixed fields, per chunk offset and checksum, trailer.
+    auto index_bound = 1 + 255 + 4 + 4 + 8 + 8 + nr_chunks * 12 + 16;
+    uint64_t pos = 0;
+    uint64_t file_len;
+    {
+        auto out = map_output_file(output, nr_chunks * c.compress_max_size(chunk_len) + index_bound);
+        size_t released = 0;
+        for (uint64_t i = 0; i < nr_chunks; i++) {
+            auto chunk = byte_span(in).subspan(i * chunk_len, chunk_len);
+            // the bound of the chunk, not the rest of the mapping, like the
+            // chunked_writer's buffer.
+            auto len = c.compress(chunk, mutable_byte_span(out).subspan(pos, c.compress_max_size(chunk.size())));
+            offsets.push_back(pos);
+            info.checksums.push_back(chunk_checksum(byte_span(out).subspan(pos, len)));
+            release_consumed_up_to(in, released, i * chunk_len + chunk.size());
+            pos += len;
+        }
+        auto index = chunked_file_format::serialize_index(info, offsets);
+        chunked_file_format::put<uint64_t>(index, pos);
+        chunked_file_format::put<uint64_t>(index, compression_info::magic);
+        memcpy(out.get() + pos, index.data(), index.size());
+        file_len = pos + index.size();
+    }
+    if (::truncate(output.c_str(), file_len) < 0) {
+        throw std::runtime_error("cannot truncate " + output + ": " + strerror(errno));
+    }
+    return pos;
+}
+
+// The reverse of compress_file_mapped(): every chunk is uncompressed from a
+// mapping of the chunked file straight into its place in a mapping of the
+// output file. Returns the uncompressed size.
+static inline uint64_t uncompress_file_mapped(const std::string& input, const std::string& output) {
+    auto info = chunked_reader::load_info(file_desc(input, O_RDONLY));
+    auto c = make_compressor(compressor_type_from_name(info.codec));
+    auto in = map_file(input, access_hint::sequential);
+    auto out = map_output_file(output, info.data_len);
+    // chunks are mostly smaller than a page.
+    size_t released = 0;
+    for (size_t i = 0; i < info.nr_chunks(); i++) {
+        auto range = info.offsets.pair_at(i);
+        auto compressed = byte_span(in).subspan(range.first, range.second - range.first);
+        if (chunk_checksum(compressed) != info.checksums[i]) {
+            throw std::runtime_error((boost::format("%1%: checksum mismatch in chunk %2%") % input % i).str());
+        }
+        auto len = info.chunk_uncompressed_len(i);
+        auto s = c->uncompress(compressed, mutable_byte_span(out).subspan(uint64_t(i) * info.chunk_len, len));
+        if (s != len) {
+            throw std::runtime_error((boost::format("%1%: chunk %2% has the wrong length") % input % i).str());
+        }
+        release_consumed_up_to(in, released, range.second);
+    }
+    return info.data_len;
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include <boost/format.hpp>
+#include "alloc_stats.hh"
+#include "byte_span.hh"
+#include "slab_allocator.hh"
+#include "custom_assert.hh"
+
+#include <lz4.h>
+#include <lz4hc.h>
+#include <snappy-c.h>
+#include <zlib.h>
+#include <malloc.h>
+
+// LZ4_compress_default(), LZ4_compress_fast() and LZ4_compress_HC() appeared in
+// 1.7.0, and LZ4HC_CLEVEL_MIN/MAX in 1.7.3. Older versions only have the
+// deprecated LZ4_compress(), with no levels.
+#if defined(LZ4_VERSION_NUMBER) && LZ4_VERSION_NUMBER >= 10703
+#define LZ4_HAS_LEVELS
+#endif
+
+enum class compressor_type {
+    none,
+    lz4,
+    deflate,
+    snappy,
+};
+
+class compressor {
+public:
+    virtual const char* name() = 0;
+    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) = 0;
+    // return bytes stored in output
+    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) = 0;
+    // return bytes used in input to generate output
+    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) = 0;
+    virtual size_t compress_max_size(size_t input_len) = 0;
+    virtual int level() = 0;
+    // levels this compressor can be constructed with, from fastest to strongest.
+    virtual std::vector<int> supported_levels() = 0;
+
+    size_t compress(byte_span input, mutable_byte_span output) {
+        return compress(input.data(), input.size(), output.data(), output.size());
+    }
+    size_t uncompress(byte_span input, mutable_byte_span output) {
+        return uncompress(input.data(), input.size(), output.data(), output.size());
+    }
+    // output.size() is the original size.
+    size_t uncompress_fast(byte_span input, mutable_byte_span output) {
+        return uncompress_fast(input.data(), input.size(), output.data(), output.size());
+    }
+};
+
+class lz4_compressor : public compressor {
+    int _level;
+public:
+    // Level 1 is LZ4's default. Negative levels use LZ4_compress_fast() with
+    // -level as acceleration, and levels from LZ4HC_CLEVEL_MIN up use LZ4 HC.
+    explicit lz4_compressor(int level = 1) : _level(level) {}
+
+    virtual const char* name() override {
+        return "lz4";
+    }
+
+    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) override {
+        if (output_len < LZ4_COMPRESSBOUND(input_len)) {
+            throw std::runtime_error("LZ4 compression failure: length of output is too small");
+        }
+
+#ifdef LZ4_HAS_LEVELS
+        int ret;
+        if (_level >= LZ4HC_CLEVEL_MIN) {
+            ret = LZ4_compress_HC(input, output, input_len, LZ4_compressBound(input_len), _level);
+        } else if (_level < 0) {
+            ret = LZ4_compress_fast(input, output, input_len, LZ4_compressBound(input_len), -_level);
+        } else {
+            ret = LZ4_compress_default(input, output, input_len, LZ4_compressBound(input_len));
+        }
+#else
+        auto ret = LZ4_compress(input, output, input_len);
+#endif
+        if (ret == 0) {
+            throw std::runtime_error("LZ4 compression failure: LZ4_compress() failed");
+        }
+        return ret;
+    }
+
+    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) override {
+        auto ret = LZ4_decompress_safe(input, output, input_len, output_len);
+        if (ret < 0) {
+            throw std::runtime_error("LZ4 uncompression failure");
+        }
+        return ret;
+    }
+
+    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) override {
+        auto ret = LZ4_decompress_fast(input, output, original_size);
+        if (ret < 0) {
+            throw std::runtime_error("LZ4 fast uncompression failure");
+        }
+        return ret;
+    }
+
+    virtual size_t compress_max_size(size_t input_len) {
+        return LZ4_COMPRESSBOUND(input_len);
+    }
+
+    virtual int level() override {
+        return _level;
+    }
+
+    virtual std::vector<int> supported_levels() override {
+#ifdef LZ4_HAS_LEVELS
+        std::vector<int> levels = { -64, -32, -16, -8, -4, -2, 1 };
+        for (auto l = LZ4HC_CLEVEL_MIN; l <= LZ4HC_CLEVEL_MAX; l++) {
+            levels.push_back(l);
+        }
+        return levels;
+#else
+        return { 1 };
+#endif
+    }
+};
+
+// Heap activity of zlib itself on the calling thread, fed by the allocation
+// hooks deflate_compressor installs in its streams.
+static alloc_counters& thread_zlib_counters() {
+    static thread_local alloc_counters counters;
+    return counters;
+}
+
+enum class zlib_allocator {
+    malloc,
+    slab,   // slab_cache of the thread creating the stream
+};
+
+class deflate_compressor : public compressor {
+    // Same as zlib's default allocator, but accounted in thread_zlib_counters().
+    static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+        auto p = malloc(size_t(items) * size);
+        if (p) {
+            thread_zlib_counters().on_alloc(malloc_usable_size(p));
+        }
+        return p;
+    }
+    static void zlib_free(voidpf opaque, voidpf address) {
+        thread_zlib_counters().on_free(malloc_usable_size(address));
+        free(address);
+    }
+    static voidpf slab_alloc(voidpf opaque, uInt items, uInt size) {
+        auto p = static_cast<slab_cache*>(opaque)->allocate(size_t(items) * size);
+        if (p) {
+            thread_zlib_counters().on_alloc(slab_cache::size_of(p));
+        }
+        return p;
+    }
+    static void slab_free(voidpf opaque, voidpf address) {
+        thread_zlib_counters().on_free(slab_cache::size_of(address));
+        static_cast<slab_cache*>(opaque)->free(address);
+    }
+    static void init_allocator(z_stream& zs) {
+        if (allocator() == zlib_allocator::slab) {
+            zs.zalloc = slab_alloc;
+            zs.zfree = slab_free;
+            zs.opaque = &slab_cache::local();
+        } else {
+            zs.zalloc = zlib_alloc;
+            zs.zfree = zlib_free;
+            zs.opaque = Z_NULL;
+        }
+    }
+
+    // zlib's lengths are uInt. Lengths that don't fit are rejected rather
+    // than silently truncated; the room for output is capped instead, so that
+    // a result that doesn't fit in it fails like one too big for the buffer.
+    static uInt zlib_len(size_t len) {
+        if (len > std::numeric_limits<uInt>::max()) {
+            throw std::runtime_error((boost::format("deflate: %1% bytes exceed zlib's length limit") % len).str());
+        }
+        return len;
+    }
+    static uInt zlib_room(size_t len) {
+        return std::min<size_t>(len, std::numeric_limits<uInt>::max());
+    }
+
+    int _level;
+public:
+    // where zlib's internal state of all streams comes from.
+    static zlib_allocator& allocator() {
+        static zlib_allocator a = zlib_allocator::malloc;
+        return a;
+    }
+
+    explicit deflate_compressor(int level = Z_DEFAULT_COMPRESSION) : _level(level) {}
+
+    virtual const char* name() override {
+        return "deflate";
+    }
+
+    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) override {
+        z_stream zs;
+        init_allocator(zs);
+        zs.avail_in = 0;
+        zs.next_in = Z_NULL;
+        if (deflateInit(&zs, _level) != Z_OK) {
+            throw std::runtime_error("deflate compression init failure");
+        }
+        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(input));
+        zs.avail_in = zlib_len(input_len);
+        zs.next_out = reinterpret_cast<unsigned char*>(output);
+        zs.avail_out = zlib_room(output_len);
+        auto res = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (res == Z_STREAM_END) {
+            return zs.total_out;
+        } else {
+            throw std::runtime_error("deflate compression failure");
+        }
+    }
+
+    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) override {
+        z_stream zs;
+        init_allocator(zs);
+        zs.avail_in = 0;
+        zs.next_in = Z_NULL;
+        if (inflateInit(&zs) != Z_OK) {
+            throw std::runtime_error("deflate uncompression init failure");
+        }
+        // yuck, zlib is not const-correct, and also uses unsigned char while we use char :-(
+        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(input));
+        zs.avail_in = zlib_len(input_len);
+        zs.next_out = reinterpret_cast<unsigned char*>(output);
+        zs.avail_out = zlib_room(output_len);
+        auto res = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (res == Z_STREAM_END) {
+            return zs.total_out;
+        } else {
+            throw std::runtime_error("deflate uncompression failure");
+        }
+    }
+
+    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) override {
+        z_stream zs;
+        init_allocator(zs);
+        zs.avail_in = 0;
+        zs.next_in = Z_NULL;
+        if (inflateInit(&zs) != Z_OK) {
+            throw std::runtime_error("deflate uncompression init failure");
+        }
+        // yuck, zlib is not const-correct, and also uses unsigned char while we use char :-(
+        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(input));
+        zs.avail_in = zlib_len(input_len);
+        zs.next_out = reinterpret_cast<unsigned char*>(output);
+        zs.avail_out = zlib_len(original_size);
+        auto res = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (res == Z_STREAM_END) {
+            assert(zs.total_out == original_size);
+            return zs.total_in;
+        } else {
+            throw std::runtime_error("deflate uncompression failure");
+        }
+    }
+
+    virtual size_t compress_max_size(size_t input_len) {
+        z_stream zs;
+        init_allocator(zs);
+        zs.avail_in = 0;
+        zs.next_in = Z_NULL;
+        if (deflateInit(&zs, _level) != Z_OK) {
+            throw std::runtime_error("deflate compression init failure");
+        }
+        auto res = deflateBound(&zs, input_len);
+        deflateEnd(&zs);
+        return res;
+    }
+
+    virtual int level() override {
+        return _level;
+    }
+
+    virtual std::vector<int> supported_levels() override {
+        return { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    }
+};
+
+class snappy_compressor : public compressor {
+public:
+    virtual const char* name() override {
+        return "snappy";
+    }
+
+    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) override {
+        auto ret = snappy_compress(input, input_len, output, &output_len);
+        if (ret != SNAPPY_OK) {
+            auto f = (boost::format("snappy compression failure: %1%") % error_msg(ret));
+            throw std::runtime_error(f.str());
+        }
+        return output_len;
+    }
+
+    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) override {
+        auto ret = snappy_uncompress(input, input_len, output, &output_len);
+        if (ret != SNAPPY_OK) {
+            auto f = (boost::format("snappy uncompression failure: %1%") % error_msg(ret));
+            throw std::runtime_error(f.str());
+        }
+        return output_len;
+    }
+
+    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) override {
+        throw std::runtime_error("snappy uncompress_fast(): operation not supported");
+    }
+
+    virtual size_t compress_max_size(size_t input_len) {
+        return snappy_max_compressed_length(input_len);
+    }
+
+    // snappy has no compression levels.
+    virtual int level() override {
+        return 0;
+    }
+
+    virtual std::vector<int> supported_levels() override {
+        return { 0 };
+    }
+private:
+    static const char* error_msg(snappy_status s) {
+        switch(s) {
+        case SNAPPY_INVALID_INPUT:
+            return "invalid input";
+        case SNAPPY_BUFFER_TOO_SMALL:
+            return "buffer too small";
+        default:
+            return "unknown";
+        }
+    }
+};
+
+static const std::vector<compressor_type> all_compressor_types = {
+    compressor_type::lz4,
+    compressor_type::deflate,
+    compressor_type::snappy,
+};
+
+static compressor_type compressor_type_from_name(const std::string& name) {
+    if (name == "lz4") {
+        return compressor_type::lz4;
+    } else if (name == "deflate") {
+        return compressor_type::deflate;
+    } else if (name == "snappy") {
+        return compressor_type::snappy;
+    }
+    throw std::runtime_error("unknown compressor: " + name);
+}
+
+static std::unique_ptr<compressor> make_compressor(compressor_type c) {
+    switch (c) {
+    case compressor_type::lz4:
+        return std::make_unique<lz4_compressor>();
+    case compressor_type::deflate:
+        return std::make_unique<deflate_compressor>();
+    case compressor_type::snappy:
+        return std::make_unique<snappy_compressor>();
+    default:
+        throw std::runtime_error("compressor not available");
+    }
+}
+
+static std::unique_ptr<compressor> make_compressor(compressor_type c, int level) {
+    std::unique_ptr<compressor> ret;
+    switch (c) {
+    case compressor_type::lz4:
+        ret = std::make_unique<lz4_compressor>(level);
+        break;
+    case compressor_type::deflate:
+        ret = std::make_unique<deflate_compressor>(level);
+        break;
+    case compressor_type::snappy:
+        ret = std::make_unique<snappy_compressor>();
+        break;
+    default:
+        throw std::runtime_error("compressor not available");
+    }
+    auto levels = ret->supported_levels();
+    if (std::find(levels.begin(), levels.end(), level) == levels.end()) {
+        auto f = boost::format("%1% does not support level %2%") % ret->name() % level;
+        throw std::runtime_error(f.str());
+    }
+    return ret;
+}
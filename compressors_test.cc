@@ -5,7 +5,7 @@
  * See the file COPYING.
  */
 
-// compile: g++ --std=c++14 compressors_test.cc -llz4 -lsnappy -lz -lboost_system
+// compile: g++ --std=c++14 -pthread compressors_test.cc alloc_stats.cc -llz4 -lsnappy -lz -lboost_system -lboost_program_options
 
 #include <memory>
 #include <iostream>
@@ -15,223 +15,219 @@
 #include <algorithm>
 #include <exception>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <map>
+#include <boost/program_options.hpp>
+#include <boost/optional.hpp>
 #include "temporary_buf.hh"
+#include "histogram.hh"
+#include "alloc_stats.hh"
+#include "precise_timer.hh"
+#include "trace.hh"
+#include "perf_control.hh"
+#include "perf_counter.hh"
+#include "buffer_pool.hh"
+#include "arena.hh"
+#include "mapped_buf.hh"
+#include "chained_buf.hh"
+#include "byte_span.hh"
+#include "compressors.hh"
+#include "chunked_file.hh"
+#include "elias_fano.hh"
 #include "custom_assert.hh"
 
-#include <lz4.h>
-#include <snappy-c.h>
-#include <zlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
-enum class compressor_type {
-    none,
-    lz4,
-    deflate,
-    snappy,
-};
-
-class compressor {
-public:
-    virtual const char* name() = 0;
-    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) = 0;
-    // return bytes stored in output
-    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) = 0;
-    // return bytes used in input to generate output
-    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) = 0;
-    virtual size_t compress_max_size(size_t input_len) = 0;
-};
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-class lz4_compressor : public compressor {
-    virtual const char* name() override {
-        return "lz4";
+// With mapped, the corpus is a read-only mapping of the file instead of a copy
+// in memory, so big files cost no memory up front and their page faults are
+// paid while compressing.
+static temporary_buf<char> load_corpus(const std::string& path, bool mapped = false) {
+    if (mapped) {
+        return map_file(path);
+    }
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f) {
+        throw std::runtime_error("cannot open corpus " + path);
+    }
+    auto size = size_t(f.tellg());
+    auto buf = temporary_buf<char>(size, uninitialized);
+    f.seekg(0);
+    if (!f.read(buf.get(), size)) {
+        throw std::runtime_error("cannot read corpus " + path);
     }
+    return buf;
+}
 
-    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) override {
-        if (output_len < LZ4_COMPRESSBOUND(input_len)) {
-            throw std::runtime_error("LZ4 compression failure: length of output is too small");
-        }
+// Text-like data to use when no corpus is given: random data doesn't compress,
+// so it would make every level look the same.
+static temporary_buf<char> synthetic_corpus(size_t len) {
+    static const std::vector<std::string> words = {
+        "compression", "chunk", "offset", "table", "partition", "key", "value",
+        "timestamp", "row", "column", "cell", "index", "summary", "filter",
+        "the", "a", "of", "and", "to", "in", "is", "for", "on", "with",
+        "0", "1", "42", "1024", "65536", "2016-01-01", "null", "true", "false",
+    };
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<size_t> pick(0, words.size() - 1);
+    std::uniform_int_distribution<int> line_len(4, 16);
 
-#ifdef HAVE_LZ4_COMPRESS_DEFAULT
-        auto ret = LZ4_compress_default(input, output, input_len, LZ4_compressBound(input_len));
-#else
-        auto ret = LZ4_compress(input, output, input_len);
-#endif
-        if (ret == 0) {
-            throw std::runtime_error("LZ4 compression failure: LZ4_compress() failed");
+    auto buf = temporary_buf<char>(len, uninitialized);
+    size_t pos = 0;
+    while (pos < len) {
+        auto n = line_len(gen);
+        for (auto i = 0; i < n && pos < len; i++) {
+            auto& w = words[pick(gen)];
+            auto l = std::min(w.size(), len - pos);
+            memcpy(buf.get() + pos, w.data(), l);
+            pos += l;
+            if (pos < len) {
+                buf.get()[pos++] = (i == n - 1) ? '\n' : ' ';
+            }
         }
-        return ret;
     }
+    return buf;
+}
 
-    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) override {
-        auto ret = LZ4_decompress_safe(input, output, input_len, output_len);
-        if (ret < 0) {
-            throw std::runtime_error("LZ4 uncompression failure");
-        }
-        return ret;
-    }
+// Chunk lengths the test, memory and sweep modes run with; can be changed with
+// --chunk-lengths or --chunk-range.
+static std::vector<size_t> chunk_lengths = { 4*1024, 16*1024, 64*1024, 256*1024 };
 
-    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) override {
-        auto ret = LZ4_decompress_fast(input, output, original_size);
-        if (ret < 0) {
-            throw std::runtime_error("LZ4 fast uncompression failure");
-        }
-        return ret;
+// Parses "min:max:step" into min, min + step, ... up to max.
+static std::vector<size_t> parse_chunk_range(const std::string& range) {
+    size_t min, max, step;
+    char sep1, sep2;
+    std::istringstream in(range);
+    if (!(in >> min >> sep1 >> max >> sep2 >> step) || sep1 != ':' || sep2 != ':' || !min || !step || min > max) {
+        throw std::runtime_error("invalid chunk range " + range + ", expected min:max:step");
     }
-
-    virtual size_t compress_max_size(size_t input_len) {
-        return LZ4_COMPRESSBOUND(input_len);
+    std::vector<size_t> ret;
+    for (auto len = min; len <= max; len += step) {
+        ret.push_back(len);
     }
+    return ret;
+}
+
+// Per-operation codec buffers come from buffer_pool with --pool, end against a
+// guard page with --guard-pages, and come straight from the heap otherwise.
+static buf_resource* buf_source = &default_resource();
+
+static temporary_buf<char> acquire_buf(size_t size) {
+    return temporary_buf<char>(size, uninitialized, *buf_source);
+}
+
+enum class cache_mode {
+    hot,    // input was just produced by compress(), so it's still in L1/L2.
+    cold,   // input is flushed out of all cache levels before each operation.
 };
 
-class deflate_compressor : public compressor {
-    virtual const char* name() override {
-        return "deflate";
-    }
-
-    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) override {
-        z_stream zs;
-        zs.zalloc = Z_NULL;
-        zs.zfree = Z_NULL;
-        zs.opaque = Z_NULL;
-        zs.avail_in = 0;
-        zs.next_in = Z_NULL;
-        if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
-            throw std::runtime_error("deflate compression init failure");
-        }
-        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(input));
-        zs.avail_in = input_len;
-        zs.next_out = reinterpret_cast<unsigned char*>(output);
-        zs.avail_out = output_len;
-        auto res = deflate(&zs, Z_FINISH);
-        deflateEnd(&zs);
-        if (res == Z_STREAM_END) {
-            return output_len - zs.avail_out;
-        } else {
-            throw std::runtime_error("deflate compression failure");
-        }
-    }
-
-    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) override {
-        z_stream zs;
-        zs.zalloc = Z_NULL;
-        zs.zfree = Z_NULL;
-        zs.opaque = Z_NULL;
-        zs.avail_in = 0;
-        zs.next_in = Z_NULL;
-        if (inflateInit(&zs) != Z_OK) {
-            throw std::runtime_error("deflate uncompression init failure");
-        }
-        // yuck, zlib is not const-correct, and also uses unsigned char while we use char :-(
-        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(input));
-        zs.avail_in = input_len;
-        zs.next_out = reinterpret_cast<unsigned char*>(output);
-        zs.avail_out = output_len;
-        auto res = inflate(&zs, Z_FINISH);
-        inflateEnd(&zs);
-        if (res == Z_STREAM_END) {
-            return output_len - zs.avail_out;
-        } else {
-            throw std::runtime_error("deflate uncompression failure");
-        }
-    }
-
-    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) override {
-        z_stream zs;
-        zs.zalloc = Z_NULL;
-        zs.zfree = Z_NULL;
-        zs.opaque = Z_NULL;
-        zs.avail_in = 0;
-        zs.next_in = Z_NULL;
-        if (inflateInit(&zs) != Z_OK) {
-            throw std::runtime_error("deflate uncompression init failure");
-        }
-        // yuck, zlib is not const-correct, and also uses unsigned char while we use char :-(
-        zs.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(input));
-        zs.avail_in = input_len;
-        zs.next_out = reinterpret_cast<unsigned char*>(output);
-        zs.avail_out = original_size;
-        auto res = inflate(&zs, Z_FINISH);
-        inflateEnd(&zs);
-        if (res == Z_STREAM_END) {
-            assert(zs.total_out == original_size);
-            return zs.total_in;
-        } else {
-            throw std::runtime_error("deflate uncompression failure");
-        }
+static const char* to_string(cache_mode m) {
+    switch (m) {
+    case cache_mode::hot:
+        return "hot";
+    case cache_mode::cold:
+        return "cold";
+    default:
+        return "unknown";
     }
+}
 
-    virtual size_t compress_max_size(size_t input_len) {
-        z_stream zs;
-        zs.zalloc = Z_NULL;
-        zs.zfree = Z_NULL;
-        zs.opaque = Z_NULL;
-        zs.avail_in = 0;
-        zs.next_in = Z_NULL;
-        if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
-            throw std::runtime_error("deflate compression init failure");
-        }
-        auto res = deflateBound(&zs, input_len);
-        deflateEnd(&zs);
-        return res;
+// Evicts [p, p + len) from the whole cache hierarchy, so that the next access
+// is served from memory, like decompression following a disk read would be.
+static void flush_cache_lines(const void* p, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    static constexpr uintptr_t cache_line_size = 64;
+    auto start = reinterpret_cast<uintptr_t>(p) & ~(cache_line_size - 1);
+    auto end = reinterpret_cast<uintptr_t>(p) + len;
+    for (auto addr = start; addr < end; addr += cache_line_size) {
+        _mm_clflush(reinterpret_cast<const void*>(addr));
     }
-};
+    _mm_mfence();
+#else
+    throw std::runtime_error("flush_cache_lines(): not supported on this architecture");
+#endif
+}
 
-class snappy_compressor : public compressor {
-    virtual const char* name() override {
-        return "snappy";
-    }
+struct latency_options {
+    // With batch > 1, each latency sample is the time of batch consecutive
+    // operations divided by batch, which amortizes the timer overhead further.
+    unsigned batch = 1;
+    // Also report the time spent around the codec call, e.g. allocating the
+    // output buffer and checking the result.
+    bool phases = false;
+    // Zero output buffers when acquiring them, as temporary_buf used to
+    // always do, to compare against leaving them uninitialized.
+    bool zero_outputs = false;
+};
 
-    virtual size_t compress(const char* input, size_t input_len, char* output, size_t output_len) override {
-        auto ret = snappy_compress(input, input_len, output, &output_len);
-        if (ret != SNAPPY_OK) {
-            auto f = (boost::format("snappy compression failure: %1%") % error_msg(ret));
-            throw std::runtime_error(f.str());
+// Boundary cases of chained_buf: copies within, across and at the edges of
+// fragments, empty fragments, and linearizing.
+static void chained_buf_test() {
+    std::cout << "testing chained_buf...\n";
+    bool failure = false;
+    try {
+        auto data = temporary_buf<char>::random(100);
+        chained_buf chain;
+        size_t pos = 0;
+        for (size_t len : { 0, 1, 10, 0, 39, 50 }) {
+            auto fragment = temporary_buf<char>(len, uninitialized);
+            memcpy(fragment.get(), data.get() + pos, len);
+            chain.append(std::move(fragment));
+            pos += len;
         }
-        return output_len;
-    }
+        assert(chain.size() == 100 && chain.nr_fragments() == 6);
 
-    virtual size_t uncompress(const char* input, size_t input_len, char* output, size_t output_len) override {
-        auto ret = snappy_uncompress(input, input_len, output, &output_len);
-        if (ret != SNAPPY_OK) {
-            auto f = (boost::format("snappy uncompression failure: %1%") % error_msg(ret));
-            throw std::runtime_error(f.str());
+        char out[105];
+        for (size_t offset = 0; offset <= 100; offset++) {
+            for (size_t len = 0; offset + len <= 100; len++) {
+                memset(out, 0, sizeof(out));
+                chain.copy_out(offset, len, out);
+                assert(memcmp(out, data.get() + offset, len) == 0);
+            }
         }
-        return output_len;
-    }
+        bool thrown = false;
+        try {
+            chain.copy_out(60, 41, out);
+        } catch (const std::out_of_range&) {
+            thrown = true;
+        }
+        assert(thrown);
 
-    virtual size_t uncompress_fast(const char* input, size_t input_len, char* output, size_t original_size) override {
-        throw std::runtime_error("snappy uncompress_fast(): operation not supported");
-    }
+        auto linear = chain.linearize();
+        assert(linear.size() == 100 && memcmp(linear.get(), data.get(), 100) == 0);
+        auto p = chain.linearize_in_place().get();
+        assert(chain.nr_fragments() == 1 && chain.size() == 100 && memcmp(p, data.get(), 100) == 0);
+        // a single fragment isn't copied again.
+        assert(chain.linearize_in_place().get() == p);
 
-    virtual size_t compress_max_size(size_t input_len) {
-        return snappy_max_compressed_length(input_len);
-    }
-private:
-    static const char* error_msg(snappy_status s) {
-        switch(s) {
-        case SNAPPY_INVALID_INPUT:
-            return "invalid input";
-        case SNAPPY_BUFFER_TOO_SMALL:
-            return "buffer too small";
-        default:
-            return "unknown";
-        }
-    }
-};
+        chained_buf tail(temporary_buf<char>(5));
+        chain.append(std::move(tail));
+        assert(!tail.size() && !tail.nr_fragments());
+        assert(chain.size() == 105 && chain.nr_fragments() == 2);
+        chain.copy_out(98, 7, out);
+        assert(memcmp(out, data.get() + 98, 2) == 0 && !out[2] && !out[6]);
 
-static std::unique_ptr<compressor> make_compressor(compressor_type c) {
-    switch (c) {
-    case compressor_type::lz4:
-        return std::make_unique<lz4_compressor>();
-    case compressor_type::deflate:
-        return std::make_unique<deflate_compressor>();
-    case compressor_type::snappy:
-        return std::make_unique<snappy_compressor>();
-    default:
-        throw std::runtime_error("compressor not available");
+        chained_buf empty;
+        assert(!empty.linearize().size() && !empty.linearize_in_place().size());
+    } catch (const std::exception& e) {
+        std::cout << "Caught exception: " << e.what() << std::endl;
+        failure = true;
     }
+    std::cout << "status: " << (failure ? "failed" : "done") << std::endl << std::endl;
 }
 
-static void compressor_test(compressor_type t) {
+static void compressor_test(compressor_type t, const precise_timer& timer, const latency_options& opts) {
     static constexpr size_t chunk_length = 4*1024;
     auto c = make_compressor(t);
     bool failure = false;
@@ -240,8 +236,8 @@ static void compressor_test(compressor_type t) {
     try {
     {   // basic compression/decompression test
         auto input = temporary_buf<char>::random(chunk_length);
-        auto compressed = temporary_buf<char>(c->compress_max_size(chunk_length));
-        auto uncompressed = temporary_buf<char>(chunk_length);
+        auto compressed = temporary_buf<char>(c->compress_max_size(chunk_length), uninitialized);
+        auto uncompressed = temporary_buf<char>(chunk_length, uninitialized);
         auto s = c->compress(input.get(), input.size(), compressed.get(), compressed.size());
         compressed.trim(s);
         s = c->uncompress(compressed.get(), compressed.size(), uncompressed.get(), uncompressed.size());
@@ -250,35 +246,44 @@ static void compressor_test(compressor_type t) {
         assert(input == uncompressed);
     }
     {   // generate a buffer with two compressed chunks and decompress both of
-        // them only using decompressed size (chunk_length).
+        // them only using decompressed size (chunk_length). The chunks are
+        // compressed back to back into the same buffer.
+        const auto max_compressed_len = c->compress_max_size(chunk_length);
+        auto compressed_chunks = temporary_buf<char>(2 * max_compressed_len, uninitialized);
+
         auto first_chunk = temporary_buf<char>::random(chunk_length);
-        auto first_compressed_chunk = temporary_buf<char>(c->compress_max_size(chunk_length));
-        auto ret = c->compress(first_chunk.get(), first_chunk.size(), first_compressed_chunk.get(), first_compressed_chunk.size());
-        first_compressed_chunk.trim(ret);
+        auto first_compressed_len = c->compress(first_chunk, mutable_byte_span(compressed_chunks).first(max_compressed_len));
 
         auto second_chunk = temporary_buf<char>::random(chunk_length);
-        auto second_compressed_chunk = temporary_buf<char>(c->compress_max_size(chunk_length));
-        ret = c->compress(second_chunk.get(), second_chunk.size(), second_compressed_chunk.get(), second_compressed_chunk.size());
-        second_compressed_chunk.trim(ret);
-
-        auto compressed_chunks = first_compressed_chunk + second_compressed_chunk;
-        assert(compressed_chunks.size() == (first_compressed_chunk.size() + second_compressed_chunk.size()));
-        assert(memcmp(compressed_chunks.get(), first_compressed_chunk.get(), first_compressed_chunk.size()) == 0);
-        assert(memcmp(compressed_chunks.get() + first_compressed_chunk.size(), second_compressed_chunk.get(), second_compressed_chunk.size()) == 0);
-
-        auto first_uncompressed_chunk = temporary_buf<char>(chunk_length + 4);
-        *(uint32_t*)(first_uncompressed_chunk.get()+chunk_length) = 0xDEADBEEF; // used to check for overflow.
-        ret = c->uncompress_fast(compressed_chunks.get(), compressed_chunks.size(), first_uncompressed_chunk.get(), chunk_length);
-        assert(ret == first_compressed_chunk.size());
+        auto second_compressed_len = c->compress(second_chunk,
+            mutable_byte_span(compressed_chunks).subspan(first_compressed_len, max_compressed_len));
+        compressed_chunks.trim(first_compressed_len + second_compressed_len);
+
+        // With --guard-pages, outputs end against a guard page and an overrun
+        // faults; otherwise a canary right past the end catches it.
+        bool guarded = dynamic_cast<guard_page_resource*>(buf_source);
+        auto acquire_output = [&] {
+            auto buf = guarded ? acquire_buf(chunk_length) : temporary_buf<char>(chunk_length + 4, uninitialized);
+            if (!guarded) {
+                *(uint32_t*)(buf.get()+chunk_length) = 0xDEADBEEF;
+            }
+            return buf;
+        };
+        auto canary_intact = [&] (temporary_buf<char>& buf) {
+            return guarded || *(uint32_t*)(buf.get()+chunk_length) == 0xDEADBEEF;
+        };
+
+        auto first_uncompressed_chunk = acquire_output();
+        auto ret = c->uncompress_fast(compressed_chunks, mutable_byte_span(first_uncompressed_chunk).first(chunk_length));
+        assert(ret == first_compressed_len);
         assert(first_uncompressed_chunk == first_chunk);
-        assert(*(uint32_t*)(first_uncompressed_chunk.get()+chunk_length) == 0xDEADBEEF);
+        assert(canary_intact(first_uncompressed_chunk));
 
-        auto second_uncompressed_chunk = temporary_buf<char>(chunk_length + 1);
-        *(uint32_t*)(first_uncompressed_chunk.get()+chunk_length) = 0xDEADBEEF;
-        ret = c->uncompress_fast(compressed_chunks.get() + ret, compressed_chunks.size() - ret, second_uncompressed_chunk.get(), chunk_length);
-        assert(ret == second_compressed_chunk.size());
+        auto second_uncompressed_chunk = acquire_output();
+        ret = c->uncompress_fast(byte_span(compressed_chunks).subspan(ret), mutable_byte_span(second_uncompressed_chunk).first(chunk_length));
+        assert(ret == second_compressed_len);
         assert(second_uncompressed_chunk == second_chunk);
-        assert(*(uint32_t*)(first_uncompressed_chunk.get()+chunk_length) == 0xDEADBEEF);
+        assert(canary_intact(second_uncompressed_chunk));
     }
     {
         struct stats {
@@ -303,44 +308,82 @@ static void compressor_test(compressor_type t) {
                 return f.str();
             }
         };
-        const std::vector<int> chunk_lengths = { 4*1024, 16*1024, 64*1024, 256*1024 };
+        // Only the codec call is timed. Acquiring the output buffer (new[] and
+        // memset), checking the result and releasing the buffer are timed on
+        // their own, and only reported when asked for.
+        struct phase_stats {
+            stats acquire;
+            stats codec;
+            stats verify;
+            stats release;
 
+            void print(const char* name, bool phases) {
+                std::cout << name << "\t" << codec.to_print() << std::endl;
+                if (phases) {
+                    std::cout << "  buffer acquire:\t" << acquire.to_print() << std::endl;
+                    std::cout << "  verify:        \t" << verify.to_print() << std::endl;
+                    std::cout << "  buffer release:\t" << release.to_print() << std::endl;
+                }
+            }
+        };
         for (auto chunk_len : chunk_lengths) {
-            std::cout << "chunk lenght: " << chunk_len << std::endl;
-
-            stats with_compressed_length;
-            stats without_compressed_length;
-
-            for (auto i = 0; i < 10000; i++) {
-                auto data = temporary_buf<char>::random(chunk_len);
-                auto compressed = temporary_buf<char>(c->compress_max_size(chunk_len));
-                auto ret = c->compress(data.get(), data.size(), compressed.get(), compressed.size());
-                compressed.trim(ret);
-
-                auto run = [] (stats& s, auto func) {
-                    auto start = std::chrono::high_resolution_clock::now();
-                    func();
-                    auto passed = std::chrono::high_resolution_clock::now() - start;
-                    auto lat = std::chrono::duration_cast<std::chrono::nanoseconds>(passed).count();
-                    s.update(lat);
-                };
+            for (auto mode : { cache_mode::hot, cache_mode::cold }) {
+                std::cout << "chunk lenght: " << chunk_len << ", " << to_string(mode) << " cache" << std::endl;
 
-                run(with_compressed_length, [&] {
-                    auto uncompressed = temporary_buf<char>(chunk_len);
-                    auto ret = c->uncompress(compressed.get(), compressed.size(), uncompressed.get(), uncompressed.size());
-                    assert(ret == chunk_len);
-                    uncompressed.trim(ret);
-                    assert(data == uncompressed);
-                });
-                run(without_compressed_length, [&] {
-                    auto uncompressed = temporary_buf<char>(chunk_len);
-                    auto ret = c->uncompress_fast(compressed.get(), c->compress_max_size(chunk_len), uncompressed.get(), chunk_len);
-                    assert(ret == compressed.size());
-                    assert(data == uncompressed);
-                });
+                phase_stats with_compressed_length;
+                phase_stats without_compressed_length;
+                const auto max_compressed_len = c->compress_max_size(chunk_len);
+
+                for (auto i = 0; i < 10000; i++) {
+                    auto data = temporary_buf<char>::random(chunk_len);
+                    auto compressed = acquire_buf(max_compressed_len);
+                    auto ret = c->compress(data.get(), data.size(), compressed.get(), compressed.size());
+                    compressed.trim(ret);
+
+                    // in cold mode, only the first operation of a batch sees a cold cache.
+                    auto run = [&] (phase_stats& s, auto codec_call, auto verify) {
+                        boost::optional<temporary_buf<char>> uncompressed;
+                        s.acquire.update(timer.time([&] {
+                            if (opts.zero_outputs) {
+                                uncompressed.emplace(chunk_len);
+                            } else {
+                                uncompressed.emplace(acquire_buf(chunk_len));
+                            }
+                        }));
+                        if (mode == cache_mode::cold) {
+                            flush_cache_lines(compressed.get(), compressed.size());
+                        }
+                        size_t ret = 0;
+                        auto start = timer.start();
+                        for (unsigned b = 0; b < opts.batch; b++) {
+                            ret = codec_call(*uncompressed);
+                        }
+                        s.codec.update(timer.elapsed_ns(start, timer.stop()) / opts.batch);
+                        s.verify.update(timer.time([&] {
+                            verify(ret, *uncompressed);
+                        }));
+                        s.release.update(timer.time([&] {
+                            uncompressed = boost::none;
+                        }));
+                    };
+
+                    run(with_compressed_length, [&] (temporary_buf<char>& uncompressed) {
+                        return c->uncompress(compressed.get(), compressed.size(), uncompressed.get(), uncompressed.size());
+                    }, [&] (size_t ret, temporary_buf<char>& uncompressed) {
+                        assert(ret == chunk_len);
+                        uncompressed.trim(ret);
+                        assert(data == uncompressed);
+                    });
+                    run(without_compressed_length, [&] (temporary_buf<char>& uncompressed) {
+                        return c->uncompress_fast(compressed.get(), max_compressed_len, uncompressed.get(), chunk_len);
+                    }, [&] (size_t ret, temporary_buf<char>& uncompressed) {
+                        assert(ret == compressed.size());
+                        assert(data == uncompressed);
+                    });
+                }
+                with_compressed_length.print("with compressed length:   ", opts.phases);
+                without_compressed_length.print("without compressed length:", opts.phases);
             }
-            std::cout << "with compressed length:   \t" << with_compressed_length.to_print() << std::endl;
-            std::cout << "without compressed length:\t" << without_compressed_length.to_print() << std::endl;
         }
     }
     } catch (const std::exception& e) {
@@ -351,10 +394,1836 @@ static void compressor_test(compressor_type t) {
     std::cout << "status: " << (failure ? "failed" : "done") << std::endl << std::endl;
 }
 
-int main(void) {
-    compressor_test(compressor_type::lz4);
-    compressor_test(compressor_type::deflate);
-    compressor_test(compressor_type::snappy);
+// Lets a group of threads leave the setup phase and start measuring together.
+class start_barrier {
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    unsigned _pending;
+public:
+    explicit start_barrier(unsigned count) : _pending(count) {}
+
+    void arrive_and_wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (--_pending == 0) {
+            _cv.notify_all();
+        } else {
+            _cv.wait(lock, [this] { return _pending == 0; });
+        }
+    }
+};
+
+static std::string format_percentiles(const latency_histogram& h) {
+    auto f = boost::format("p50: %1%, p90: %2%, p99: %3%, p999: %4%, max: %5%")
+        % h.percentile(50) % h.percentile(90) % h.percentile(99) % h.percentile(99.9) % h.max();
+    return f.str();
+}
+
+// Runs independent compress/uncompress loops on 1, 2, 4 ... max_threads threads
+// at the same time, and reports aggregate throughput, latency percentiles and
+// scaling efficiency relative to a single thread.
+static void threads_test(compressor_type t, const precise_timer& timer, unsigned max_threads, size_t chunk_len, std::chrono::milliseconds duration) {
+    static constexpr size_t inputs_per_thread = 16;
+
+    std::cout << "testing " << make_compressor(t)->name() << " scaling, chunk length: " << chunk_len << "...\n";
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned n = 1; n < max_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(max_threads);
+
+    double single_thread_throughput = 0;
+    for (auto nr_threads : thread_counts) {
+        struct thread_result {
+            latency_histogram compress_lat;
+            latency_histogram uncompress_lat;
+            uint64_t bytes = 0;
+            uint64_t ops = 0;
+            // calls into the global allocator, where threads contend.
+            uint64_t heap_allocs = 0;
+            std::exception_ptr error;
+        };
+        std::vector<thread_result> results(nr_threads);
+
+        // std::rand() takes a lock, so inputs are generated before anything is measured.
+        std::vector<std::vector<temporary_buf<char>>> inputs(nr_threads);
+        for (auto& thread_inputs : inputs) {
+            for (size_t i = 0; i < inputs_per_thread; i++) {
+                thread_inputs.push_back(temporary_buf<char>::random(chunk_len));
+            }
+        }
+
+        start_barrier barrier(nr_threads + 1);
+        std::atomic<bool> stop = { false };
+        std::vector<std::thread> threads;
+        for (unsigned id = 0; id < nr_threads; id++) {
+            threads.emplace_back([&, id] {
+                auto& r = results[id];
+                bool started = false;
+                try {
+                    auto c = make_compressor(t);
+                    auto compressed = temporary_buf<char>(c->compress_max_size(chunk_len));
+                    auto uncompressed = temporary_buf<char>(chunk_len);
+                    auto& thread_inputs = inputs[id];
+
+                    // the first round also checks that data survives the round trip.
+                    for (auto& input : thread_inputs) {
+                        auto s = c->compress(input.get(), input.size(), compressed.get(), compressed.size());
+                        s = c->uncompress(compressed.get(), s, uncompressed.get(), uncompressed.size());
+                        assert(s == chunk_len);
+                        assert(input == uncompressed);
+                    }
+
+                    barrier.arrive_and_wait();
+                    started = true;
+                    alloc_probe heap(thread_heap_counters());
+                    for (size_t i = 0; !stop.load(std::memory_order_relaxed); i++) {
+                        auto& input = thread_inputs[i % inputs_per_thread];
+
+                        size_t s;
+                        r.compress_lat.record(timer.time([&] {
+                            s = c->compress(input.get(), input.size(), compressed.get(), compressed.size());
+                        }));
+                        r.uncompress_lat.record(timer.time([&] {
+                            c->uncompress(compressed.get(), s, uncompressed.get(), uncompressed.size());
+                        }));
+                        r.bytes += chunk_len;
+                        r.ops += 2;
+                    }
+                    r.heap_allocs = heap.done().allocs;
+                } catch (...) {
+                    r.error = std::current_exception();
+                    stop.store(true);
+                    if (!started) {
+                        barrier.arrive_and_wait();
+                    }
+                }
+            });
+        }
+
+        barrier.arrive_and_wait();
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(duration);
+        stop.store(true);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        latency_histogram compress_lat;
+        latency_histogram uncompress_lat;
+        uint64_t bytes = 0;
+        uint64_t ops = 0;
+        uint64_t heap_allocs = 0;
+        for (auto& r : results) {
+            if (r.error) {
+                std::rethrow_exception(r.error);
+            }
+            compress_lat.merge(r.compress_lat);
+            uncompress_lat.merge(r.uncompress_lat);
+            bytes += r.bytes;
+            ops += r.ops;
+            heap_allocs += r.heap_allocs;
+        }
+
+        // each byte is compressed and uncompressed once.
+        auto throughput = bytes / elapsed / (1024 * 1024);
+        if (nr_threads == 1) {
+            single_thread_throughput = throughput;
+        }
+        auto efficiency = single_thread_throughput ? throughput / (single_thread_throughput * nr_threads) * 100 : 0;
+
+        std::cout << boost::format("threads: %1%, round trip: %2$.1f MB/s, scaling efficiency: %3$.1f%%, heap allocs/op: %4$.2f")
+            % nr_threads % throughput % efficiency % (double(heap_allocs) / std::max<uint64_t>(ops, 1)) << std::endl;
+        std::cout << "compress latency:  \t" << format_percentiles(compress_lat) << std::endl;
+        std::cout << "uncompress latency:\t" << format_percentiles(uncompress_lat) << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+// Sizes zlib allocates for a deflate stream at the default level and for an
+// inflate stream, recorded by setting them up once.
+static std::vector<size_t> zlib_allocation_sizes() {
+    std::vector<size_t> sizes;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = [] (voidpf opaque, uInt items, uInt size) -> voidpf {
+        static_cast<std::vector<size_t>*>(opaque)->push_back(size_t(items) * size);
+        return calloc(items, size);
+    };
+    zs.zfree = [] (voidpf, voidpf address) {
+        free(address);
+    };
+    zs.opaque = &sizes;
+    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        throw std::runtime_error("deflate compression init failure");
+    }
+    deflateEnd(&zs);
+
+    // inflating in one Z_FINISH call, as deflate_compressor does, doesn't
+    // allocate a window on top of the state.
+    if (inflateInit(&zs) != Z_OK) {
+        throw std::runtime_error("deflate uncompression init failure");
+    }
+    inflateEnd(&zs);
+    return sizes;
+}
+
+// Contention on the allocator zlib's state comes from: 1, 2, 4 ...
+// max_threads threads allocate and free, back to back, what a deflate and an
+// inflate stream allocate, either with malloc or with each thread's
+// slab_cache. Only the allocator runs, so the drop in rounds per second per
+// thread, and the growth of the tail latency, as threads are added is what
+// they wait on each other in the allocator.
+static void zlib_alloc_test(const precise_timer& timer, unsigned max_threads, std::chrono::milliseconds duration) {
+    auto sizes = zlib_allocation_sizes();
+    std::cout << "testing zlib state allocation contention, " << sizes.size() << " allocations of";
+    for (auto size : sizes) {
+        std::cout << " " << size;
+    }
+    std::cout << " bytes per round...\n";
+    std::cout << boost::format("%8s %-8s %16s %14s %10s %10s %10s")
+        % "threads" % "alloc" % "rounds/s/thread" % "scaling" % "p50 ns" % "p99 ns" % "max ns" << std::endl;
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned n = 1; n < max_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(max_threads);
+
+    for (auto slab : { false, true }) {
+        double single_thread_rate = 0;
+        for (auto nr_threads : thread_counts) {
+            struct thread_result {
+                latency_histogram lat;
+                uint64_t rounds = 0;
+                std::exception_ptr error;
+            };
+            std::vector<thread_result> results(nr_threads);
+            start_barrier barrier(nr_threads + 1);
+            std::atomic<bool> stop = { false };
+            std::vector<std::thread> threads;
+            for (unsigned id = 0; id < nr_threads; id++) {
+                threads.emplace_back([&, id] {
+                    auto& r = results[id];
+                    std::vector<void*> objects(sizes.size());
+                    auto& cache = slab_cache::local();
+                    auto round = [&] {
+                        for (size_t i = 0; i < sizes.size(); i++) {
+                            objects[i] = slab ? cache.allocate(sizes[i]) : malloc(sizes[i]);
+                        }
+                        for (auto p : objects) {
+                            slab ? cache.free(p) : free(p);
+                        }
+                    };
+                    try {
+                        // warms up the slabs, and checks allocations succeed.
+                        for (size_t i = 0; i < sizes.size(); i++) {
+                            objects[i] = slab ? cache.allocate(sizes[i]) : malloc(sizes[i]);
+                            assert(objects[i]);
+                        }
+                        for (auto p : objects) {
+                            slab ? cache.free(p) : free(p);
+                        }
+                    } catch (...) {
+                        r.error = std::current_exception();
+                    }
+                    barrier.arrive_and_wait();
+                    while (!r.error && !stop.load(std::memory_order_relaxed)) {
+                        r.lat.record(timer.time(round));
+                        r.rounds++;
+                    }
+                });
+            }
+
+            barrier.arrive_and_wait();
+            auto start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(duration);
+            stop.store(true);
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            latency_histogram lat;
+            uint64_t rounds = 0;
+            for (auto& r : results) {
+                if (r.error) {
+                    std::rethrow_exception(r.error);
+                }
+                lat.merge(r.lat);
+                rounds += r.rounds;
+            }
+            auto rate = rounds / elapsed / nr_threads;
+            if (nr_threads == 1) {
+                single_thread_rate = rate;
+            }
+            std::cout << boost::format("%8d %-8s %16.0f %13.1f%% %10d %10d %10d") % nr_threads
+                % (slab ? "slab" : "malloc") % rate % (100 * rate / single_thread_rate)
+                % lat.percentile(50) % lat.percentile(99) % lat.max() << std::endl;
+        }
+    }
+    std::cout << std::endl;
+}
+
+// Averages of alloc_counters over a number of operations.
+class alloc_summary {
+    uint64_t _ops = 0;
+    uint64_t _allocs = 0;
+    uint64_t _bytes = 0;
+    int64_t _max_peak = 0;
+public:
+    void add(const alloc_counters& op) {
+        _ops++;
+        _allocs += op.allocs;
+        _bytes += op.bytes;
+        _max_peak = std::max(_max_peak, op.peak);
+    }
+    std::string to_print() const {
+        auto ops = std::max<uint64_t>(_ops, 1);
+        auto f = boost::format("allocs/op: %1$.2f, bytes/op: %2%, peak heap/op: %3%")
+            % (double(_allocs) / ops) % (_bytes / ops) % _max_peak;
+        return f.str();
+    }
+};
+
+// Reports, for each chunk length, heap allocations and bytes allocated per
+// operation, the highest the heap grew during a single operation, and the
+// peak RSS of the whole run. Allocations made through zlib's hooks are also
+// reported on their own. Last, it compares uncompressing into an output
+// buffer acquired and released around each operation from the heap and from
+// buffer_pool.
+static void memory_test(compressor_type t, const precise_timer& timer) {
+    static constexpr int iterations = 1000;
+    auto c = make_compressor(t);
+    std::cout << "testing " << c->name() << " memory usage...\n";
+
+    for (auto chunk_len : chunk_lengths) {
+        auto input = temporary_buf<char>::random(chunk_len);
+        auto compressed = temporary_buf<char>(c->compress_max_size(chunk_len));
+        auto uncompressed = temporary_buf<char>(chunk_len);
+
+        alloc_summary compress_heap, compress_zlib;
+        alloc_summary uncompress_heap, uncompress_zlib;
+
+        reset_peak_rss();
+        for (auto i = 0; i < iterations; i++) {
+            size_t s;
+            {
+                alloc_probe heap(thread_heap_counters());
+                alloc_probe zlib(thread_zlib_counters());
+                s = c->compress(input.get(), input.size(), compressed.get(), compressed.size());
+                compress_heap.add(heap.done());
+                compress_zlib.add(zlib.done());
+            }
+            {
+                alloc_probe heap(thread_heap_counters());
+                alloc_probe zlib(thread_zlib_counters());
+                s = c->uncompress(compressed.get(), s, uncompressed.get(), uncompressed.size());
+                uncompress_heap.add(heap.done());
+                uncompress_zlib.add(zlib.done());
+            }
+            assert(s == chunk_len);
+        }
+        auto rss = peak_rss();
+
+        std::cout << "chunk lenght: " << chunk_len << ", peak RSS: " << rss / 1024 << " kB" << std::endl;
+        std::cout << "compress:           \t" << compress_heap.to_print() << std::endl;
+        if (t == compressor_type::deflate) {
+            std::cout << "  through zlib hooks:\t" << compress_zlib.to_print() << std::endl;
+        }
+        std::cout << "uncompress:         \t" << uncompress_heap.to_print() << std::endl;
+        if (t == compressor_type::deflate) {
+            std::cout << "  through zlib hooks:\t" << uncompress_zlib.to_print() << std::endl;
+        }
+
+        auto compressed_len = c->compress(input.get(), input.size(), compressed.get(), compressed.size());
+        for (auto pooled : { false, true }) {
+            alloc_summary heap_summary;
+            latency_histogram lat;
+            auto pool_before = buffer_pool::thread_stats();
+            for (auto i = 0; i < iterations; i++) {
+                alloc_probe heap(thread_heap_counters());
+                lat.record(timer.time([&] {
+                    auto output = pooled ? buffer_pool::get(chunk_len) : temporary_buf<char>(chunk_len, uninitialized);
+                    c->uncompress(compressed.get(), compressed_len, output.get(), output.size());
+                }));
+                heap_summary.add(heap.done());
+            }
+            std::cout << (pooled ? "  with pooled buffer:\t" : "  with heap buffer:  \t") << heap_summary.to_print()
+                << ", p50: " << lat.percentile(50) << " ns";
+            if (pooled) {
+                auto pool = buffer_pool::thread_stats();
+                std::cout << boost::format(", pool hits: %1%, misses: %2%, unpooled: %3%")
+                    % (pool.hits - pool_before.hits) % (pool.misses - pool_before.misses)
+                    % (pool.unpooled - pool_before.unpooled);
+            }
+            std::cout << std::endl;
+        }
+    }
+    std::cout << std::endl;
+}
+
+// Compresses batches of chunks, where every intermediate buffer (compressed
+// output and a small per-chunk header) lives as long as the batch, taking
+// them one by one from each buf_resource: the heap, buffer_pool, and arenas
+// reset at the end of each batch, with heap, huge page or NUMA-local blocks.
+// The blocks of the huge page and NUMA arenas hold a whole batch, so those
+// rows measure the placement of the memory rather than a mapping per buffer.
+// Reports allocations and latency per batch.
+static void batch_test(compressor_type t, const precise_timer& timer, size_t chunk_len, size_t batch_size) {
+    static constexpr int iterations = 1000;
+    static constexpr size_t header_len = 16;
+    auto c = make_compressor(t);
+    std::cout << "testing " << c->name() << " batches of " << batch_size << " chunks of " << chunk_len << " bytes...\n";
+
+    auto corpus = synthetic_corpus(chunk_len * batch_size);
+    auto max_compressed_len = c->compress_max_size(chunk_len);
+    std::vector<temporary_buf<char>> buffers;
+    buffers.reserve(batch_size * 2);
+
+    // a batch, with each buffer cache line aligned.
+    auto slot = [] (size_t len) { return buf_alloc::align_up(len, alloc_policy::cache_line_size); };
+    auto batch_len = batch_size * (slot(header_len) + slot(max_compressed_len));
+    auto huge_batch_len = buf_alloc::align_up(batch_len, alloc_policy::huge_page_size);
+    policy_resource heap;
+    numa_resource numa_local;
+    arena a;
+    arena thp(huge_batch_len, alloc_policy::huge_page_aligned(huge_pages::madvise));
+    arena numa(batch_len, numa_local);
+    std::pair<const char*, buf_resource*> sources[] = {
+        { "heap", &heap },
+        { "pool", &buffer_pool::resource() },
+        { "arena", &a },
+        { "THP", &thp },
+        { "NUMA", &numa },
+    };
+    for (auto& src : sources) {
+        alloc_summary summary;
+        latency_histogram lat;
+        for (auto i = 0; i < iterations; i++) {
+            alloc_probe probe(thread_heap_counters());
+            lat.record(timer.time([&] {
+                for (size_t j = 0; j < batch_size; j++) {
+                    auto header = temporary_buf<char>(header_len, uninitialized, *src.second);
+                    auto compressed = temporary_buf<char>(max_compressed_len, uninitialized, *src.second);
+                    auto s = c->compress(byte_span(corpus).subspan(j * chunk_len, chunk_len), compressed);
+                    compressed.trim(s);
+                    memcpy(header.get(), &s, sizeof(s));
+                    buffers.push_back(std::move(header));
+                    buffers.push_back(std::move(compressed));
+                }
+                buffers.clear();
+                if (auto ar = dynamic_cast<arena*>(src.second)) {
+                    ar->reset();
+                }
+            }));
+            summary.add(probe.done());
+        }
+        std::cout << boost::format("%-6s\t%s, p50: %d ns, p99: %d ns")
+            % src.first % summary.to_print() % lat.percentile(50) % lat.percentile(99) << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+// Compresses a whole file once, chunk by chunk, straight from a read-only
+// mapping into an anonymous mapping, so that files bigger than memory can be
+// used. The input is mapped MADV_SEQUENTIAL and pages are dropped with
+// MADV_DONTNEED once compressed. Throughput includes page faults and
+// readahead, which are reported too.
+static void stream_test(compressor_type t, const std::string& path, size_t chunk_len) {
+    auto c = make_compressor(t);
+    std::cout << "streaming " << path << " through " << c->name() << ", chunk length: " << chunk_len << "...\n";
+
+    auto input = map_file(path, access_hint::sequential);
+    auto nr_chunks = (input.size() + chunk_len - 1) / chunk_len;
+    auto output = map_anonymous(nr_chunks * c->compress_max_size(chunk_len));
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    auto start = std::chrono::steady_clock::now();
+    size_t out_pos = 0;
+    size_t released = 0;
+    for (size_t pos = 0; pos < input.size(); pos += chunk_len) {
+        auto chunk = byte_span(input).subspan(pos, chunk_len);
+        // bounded, as codecs may not take the rest of a multi-GB mapping as a length.
+        out_pos += c->compress(chunk, mutable_byte_span(output).subspan(out_pos, c->compress_max_size(chunk.size())));
+        release_consumed_up_to(input, released, pos + chunk.size());
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    getrusage(RUSAGE_SELF, &after);
+
+    std::cout << boost::format("%1% bytes -> %2% bytes (ratio %3$.3f) in %4$.3f s, %5$.1f MB/s, major faults: %6%, minor faults: %7%")
+        % input.size() % out_pos % (double(input.size()) / std::max<size_t>(out_pos, 1)) % elapsed
+        % (input.size() / elapsed / (1024 * 1024)) % (after.ru_majflt - before.ru_majflt) % (after.ru_minflt - before.ru_minflt)
+        << std::endl << std::endl;
+}
+
+struct sweep_result {
+    std::string name;
+    int level;
+    double compress_mbps;
+    double uncompress_mbps;
+    double ratio;
+    bool pareto = false;
+
+    bool dominates(const sweep_result& o) const {
+        return compress_mbps >= o.compress_mbps && uncompress_mbps >= o.uncompress_mbps && ratio >= o.ratio
+            && (compress_mbps > o.compress_mbps || uncompress_mbps > o.uncompress_mbps || ratio > o.ratio);
+    }
+};
+
+// Compresses and uncompresses the corpus split in chunks of chunk_len, repeating
+// each pass until it has run for a minimum time, and returns the speeds and ratio.
+static sweep_result sweep_one(compressor& c, const temporary_buf<char>& corpus, size_t chunk_len) {
+    static constexpr std::chrono::milliseconds min_duration(200);
+
+    chunk_len = std::min(chunk_len, corpus.size());
+    auto nr_chunks = corpus.size() / chunk_len;
+    std::vector<temporary_buf<char>> compressed;
+    std::vector<size_t> compressed_lens(nr_chunks);
+    for (size_t i = 0; i < nr_chunks; i++) {
+        compressed.emplace_back(c.compress_max_size(chunk_len));
+    }
+    auto uncompressed = temporary_buf<char>(chunk_len);
+
+    auto measure = [] (auto pass) {
+        size_t rounds = 0;
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::steady_clock::duration(0);
+        do {
+            pass();
+            rounds++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed < min_duration);
+        return std::chrono::duration<double>(elapsed).count() / rounds;
+    };
+
+    auto compress_time = measure([&] {
+        for (size_t i = 0; i < nr_chunks; i++) {
+            compressed_lens[i] = c.compress(corpus.get() + i * chunk_len, chunk_len, compressed[i].get(), compressed[i].size());
+        }
+    });
+    auto uncompress_time = measure([&] {
+        for (size_t i = 0; i < nr_chunks; i++) {
+            c.uncompress(compressed[i].get(), compressed_lens[i], uncompressed.get(), uncompressed.size());
+        }
+    });
+
+    size_t total_compressed = 0;
+    for (size_t i = 0; i < nr_chunks; i++) {
+        auto s = c.uncompress(compressed[i].get(), compressed_lens[i], uncompressed.get(), uncompressed.size());
+        assert(s == chunk_len);
+        assert(memcmp(uncompressed.get(), corpus.get() + i * chunk_len, chunk_len) == 0);
+        total_compressed += compressed_lens[i];
+    }
+
+    auto total = double(nr_chunks * chunk_len);
+    sweep_result r;
+    r.name = c.name();
+    r.level = c.level();
+    r.compress_mbps = total / compress_time / (1024 * 1024);
+    r.uncompress_mbps = total / uncompress_time / (1024 * 1024);
+    r.ratio = total / total_compressed;
+    return r;
+}
+
+// Runs every compressor at every level it supports over the corpus, for each
+// chunk length, and marks the configurations not beaten on compression speed,
+// uncompression speed and ratio at the same time by any other.
+static void sweep_test(const std::vector<compressor_type>& types, const temporary_buf<char>& corpus) {
+    for (auto chunk_len : chunk_lengths) {
+        std::vector<sweep_result> results;
+        for (auto t : types) {
+            for (auto level : make_compressor(t)->supported_levels()) {
+                auto c = make_compressor(t, level);
+                results.push_back(sweep_one(*c, corpus, chunk_len));
+            }
+        }
+        for (auto& r : results) {
+            r.pareto = std::none_of(results.begin(), results.end(), [&r] (const sweep_result& o) {
+                return o.dominates(r);
+            });
+        }
+
+        std::cout << "chunk lenght: " << chunk_len << ", corpus size: " << corpus.size() << std::endl;
+        std::cout << boost::format("%-10s %6s %14s %16s %8s %s") % "compressor" % "level" % "compress MB/s" % "uncompress MB/s" % "ratio" % "pareto" << std::endl;
+        for (auto& r : results) {
+            std::cout << boost::format("%-10s %6d %14.1f %16.1f %8.3f %s")
+                % r.name % r.level % r.compress_mbps % r.uncompress_mbps % r.ratio % (r.pareto ? "*" : "") << std::endl;
+        }
+        std::cout << std::endl;
+    }
+}
+
+struct soak_options {
+    size_t chunk_len;
+    std::chrono::seconds duration;
+    std::chrono::seconds interval;
+    // fraction of operations that are uncompressions.
+    double read_ratio;
+};
+
+// Runs a mix of compressions and uncompressions for opts.duration, and prints
+// latency percentiles, throughput, RSS and live heap every opts.interval, so
+// that slowdowns that only show up over time (allocator growth, fragmentation,
+// thermal throttling) become visible. Compressed chunks are kept in a window
+// and replaced at random, so buffers have varied lifetimes like in a cache.
+static void soak_test(compressor_type t, const precise_timer& timer, const soak_options& opts) {
+    static constexpr size_t window_size = 1024;
+    static constexpr size_t nr_inputs = 256;
+
+    auto c = make_compressor(t);
+    std::cout << "soaking " << c->name() << ", chunk length: " << opts.chunk_len << "...\n";
+
+    // slices of a compressible corpus, so that compressed sizes vary.
+    auto corpus = synthetic_corpus(opts.chunk_len * 2);
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<size_t> pick_offset(0, opts.chunk_len);
+    std::vector<temporary_buf<char>> inputs;
+    inputs.reserve(nr_inputs);
+    for (size_t i = 0; i < nr_inputs; i++) {
+        inputs.emplace_back(opts.chunk_len, uninitialized);
+        memcpy(inputs.back().get(), corpus.get() + pick_offset(gen), opts.chunk_len);
+    }
+
+    latency_histogram compress_lat, uncompress_lat;
+    uint64_t compress_bytes = 0, uncompress_bytes = 0;
+    auto compress_one = [&] (size_t input) {
+        auto compressed = acquire_buf(c->compress_max_size(opts.chunk_len));
+        size_t s;
+        compress_lat.record(timer.time([&] {
+            s = c->compress(inputs[input].get(), opts.chunk_len, compressed.get(), compressed.size());
+        }));
+        compressed.trim(s);
+        compress_bytes += opts.chunk_len;
+        return compressed;
+    };
+
+    struct slot {
+        size_t input;
+        boost::optional<temporary_buf<char>> compressed;
+    };
+    std::vector<slot> window;
+    window.reserve(window_size);
+    std::uniform_int_distribution<size_t> pick_input(0, nr_inputs - 1);
+    std::uniform_int_distribution<size_t> pick_slot(0, window_size - 1);
+    std::uniform_real_distribution<double> pick_op(0, 1);
+    for (size_t i = 0; i < window_size; i++) {
+        auto input = pick_input(gen);
+        window.push_back(slot{input, compress_one(input)});
+    }
+
+    std::cout << boost::format("%8s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s")
+        % "time(s)" % "comp MB/s" % "comp p50" % "comp p99" % "comp max"
+        % "unc MB/s" % "unc p50" % "unc p99" % "unc max" % "RSS(kB)" % "heap(kB)" << std::endl;
+
+    compress_lat.reset();
+    compress_bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto interval_start = start;
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        // stops at the duration, even in the middle of an interval.
+        auto done = now - start >= opts.duration;
+        if (done || now - interval_start >= opts.interval) {
+            auto secs = std::chrono::duration<double>(now - interval_start).count();
+            auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - start).count();
+            std::cout << boost::format("%8d %10.1f %10d %10d %10d %10.1f %10d %10d %10d %10d %10d")
+                % elapsed
+                % (compress_bytes / secs / (1024 * 1024)) % compress_lat.percentile(50) % compress_lat.percentile(99) % compress_lat.max()
+                % (uncompress_bytes / secs / (1024 * 1024)) % uncompress_lat.percentile(50) % uncompress_lat.percentile(99) % uncompress_lat.max()
+                % (current_rss() / 1024) % (thread_heap_counters().live / 1024) << std::endl;
+            compress_lat.reset();
+            uncompress_lat.reset();
+            compress_bytes = uncompress_bytes = 0;
+            interval_start = now;
+            if (done) {
+                break;
+            }
+        }
+
+        auto& sl = window[pick_slot(gen)];
+        if (pick_op(gen) >= opts.read_ratio) {
+            sl.input = pick_input(gen);
+            sl.compressed = boost::none;
+            sl.compressed.emplace(compress_one(sl.input));
+        } else {
+            auto& compressed = *sl.compressed;
+            auto uncompressed = acquire_buf(opts.chunk_len);
+            size_t s;
+            uncompress_lat.record(timer.time([&] {
+                s = c->uncompress(compressed.get(), compressed.size(), uncompressed.get(), uncompressed.size());
+            }));
+            uncompress_bytes += opts.chunk_len;
+            assert(s == opts.chunk_len);
+            assert(uncompressed == inputs[sl.input]);
+        }
+    }
+    std::cout << std::endl;
+}
+
+enum class replay_mode {
+    // operations are issued at their recorded arrival times, whether or not
+    // the previous ones are done, so latency includes queueing delay.
+    open_loop,
+    // operations are issued back to back, each when the previous completes.
+    closed_loop,
+};
+
+struct replay_options {
+    replay_mode mode;
+    // > 1 replays the trace faster than it was recorded.
+    double speed;
+};
+
+// Where a record's data comes from in the corpus: its own offset if the trace
+// has one, or else an offset derived from its size, so that only one
+// compressed chunk per size has to be prepared for uncompressions.
+static size_t trace_data_offset(const trace_record& r, const temporary_buf<char>& corpus) {
+    auto off = r.data_offset ? *r.data_offset : r.size * uint64_t(2654435761u);
+    return off % (corpus.size() - r.size + 1);
+}
+
+// Drives the compressor with the operation mix, chunk sizes and inter-arrival
+// times of a recorded trace, and reports service time, and in open loop also
+// queueing delay and response time, for each operation.
+static void replay_test(compressor_type t, const precise_timer& timer, const std::vector<trace_record>& trace,
+        const temporary_buf<char>& corpus, const replay_options& opts) {
+    auto c = make_compressor(t);
+    std::cout << "replaying " << trace.size() << " operations on " << c->name() << " ("
+        << (opts.mode == replay_mode::open_loop ? "open" : "closed") << " loop, speed " << opts.speed << "x)...\n";
+
+    size_t max_size = 0;
+    std::map<std::pair<size_t, size_t>, temporary_buf<char>> compressed_chunks;
+    for (auto& r : trace) {
+        if (r.size > corpus.size()) {
+            throw std::runtime_error((boost::format("trace record of %1% bytes is bigger than the corpus") % r.size).str());
+        }
+        max_size = std::max(max_size, r.size);
+        auto key = std::make_pair(trace_data_offset(r, corpus), r.size);
+        if (r.op == trace_op::uncompress && !compressed_chunks.count(key)) {
+            auto compressed = temporary_buf<char>(c->compress_max_size(r.size), uninitialized);
+            auto s = c->compress(corpus.get() + key.first, r.size, compressed.get(), compressed.size());
+            compressed.trim(s);
+            compressed_chunks.emplace(key, std::move(compressed));
+        }
+    }
+    auto output = temporary_buf<char>(c->compress_max_size(max_size));
+
+    struct op_stats {
+        latency_histogram service;
+        latency_histogram queueing;
+        latency_histogram response;
+        uint64_t bytes = 0;
+    };
+    op_stats compress_stats, uncompress_stats;
+
+    auto to_ns = [] (std::chrono::steady_clock::duration d) {
+        return uint64_t(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    };
+    auto origin = trace.front().timestamp_us;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& r : trace) {
+        auto scheduled = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::micro>((r.timestamp_us - origin) / opts.speed));
+        if (opts.mode == replay_mode::open_loop) {
+            // sleep while far from the arrival time, then spin for precision.
+            for (auto now = std::chrono::steady_clock::now(); now < scheduled; now = std::chrono::steady_clock::now()) {
+                if (scheduled - now > std::chrono::microseconds(200)) {
+                    std::this_thread::sleep_for(scheduled - now - std::chrono::microseconds(100));
+                }
+            }
+        }
+
+        auto& st = (r.op == trace_op::compress) ? compress_stats : uncompress_stats;
+        auto off = trace_data_offset(r, corpus);
+        auto issued = std::chrono::steady_clock::now();
+        size_t s;
+        if (r.op == trace_op::compress) {
+            st.service.record(timer.time([&] {
+                s = c->compress(corpus.get() + off, r.size, output.get(), output.size());
+            }));
+        } else {
+            auto& compressed = compressed_chunks.at(std::make_pair(off, r.size));
+            st.service.record(timer.time([&] {
+                s = c->uncompress(compressed.get(), compressed.size(), output.get(), r.size);
+            }));
+            assert(s == r.size);
+        }
+        auto done = std::chrono::steady_clock::now();
+        st.bytes += r.size;
+        if (opts.mode == replay_mode::open_loop) {
+            st.queueing.record(to_ns(issued - scheduled));
+            st.response.record(to_ns(done - scheduled));
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto span = (trace.back().timestamp_us - origin) / 1e6 / opts.speed;
+
+    std::cout << boost::format("elapsed: %1$.3f s (trace span: %2$.3f s), %3$.0f ops/s")
+        % elapsed % span % (trace.size() / elapsed) << std::endl;
+    auto print = [&] (const char* name, const op_stats& st) {
+        std::cout << boost::format("%1%: %2% ops, %3$.1f MB/s") % name % st.service.count() % (st.bytes / elapsed / (1024 * 1024)) << std::endl;
+        if (!st.service.count()) {
+            return;
+        }
+        std::cout << "  service: \t" << format_percentiles(st.service) << std::endl;
+        if (opts.mode == replay_mode::open_loop) {
+            std::cout << "  queueing:\t" << format_percentiles(st.queueing) << std::endl;
+            std::cout << "  response:\t" << format_percentiles(st.response) << std::endl;
+        }
+    };
+    print("compress", compress_stats);
+    print("uncompress", uncompress_stats);
+    std::cout << std::endl;
+}
+
+// Fast paths of codecs depend on the alignment of their buffers and on block
+// size thresholds, and real buffers are often unaligned slices of larger I/O
+// buffers. So, for each chunk length and each combination of input and output
+// offsets from a page boundary, this reports median compression and
+// uncompression latency.
+static void alignment_test(compressor_type t, const precise_timer& timer, const std::vector<size_t>& lengths,
+        const std::vector<size_t>& offsets) {
+    static constexpr int iterations = 200;
+    auto c = make_compressor(t);
+    std::cout << "testing " << c->name() << " alignment sensitivity...\n";
+    std::cout << boost::format("%10s %8s %8s %14s %14s %12s %12s")
+        % "length" % "in off" % "out off" % "compress p50" % "uncomp p50" % "comp ns/KB" % "uncomp ns/KB" << std::endl;
+
+    auto max_offset = *std::max_element(offsets.begin(), offsets.end());
+    for (auto len : lengths) {
+        auto corpus = synthetic_corpus(len);
+        auto max_compressed_len = c->compress_max_size(len);
+        auto base_len = std::max(len, max_compressed_len) + max_offset;
+        auto in_base = temporary_buf<char>(base_len, uninitialized, alloc_policy::page_aligned());
+        auto out_base = temporary_buf<char>(base_len, uninitialized, alloc_policy::page_aligned());
+
+        for (auto in_off : offsets) {
+            for (auto out_off : offsets) {
+                auto in = in_base.get() + in_off;
+                auto out = out_base.get() + out_off;
+                latency_histogram compress_lat, uncompress_lat;
+                size_t compressed_len;
+
+                memcpy(in, corpus.get(), len);
+                for (auto i = 0; i < iterations; i++) {
+                    compress_lat.record(timer.time([&] {
+                        compressed_len = c->compress(in, len, out, max_compressed_len);
+                    }));
+                }
+                // uncompress from in_off into out_off as well.
+                memcpy(in, out, compressed_len);
+                for (auto i = 0; i < iterations; i++) {
+                    uncompress_lat.record(timer.time([&] {
+                        c->uncompress(in, compressed_len, out, len);
+                    }));
+                }
+                assert(memcmp(out, corpus.get(), len) == 0);
+
+                std::cout << boost::format("%10d %8d %8d %14d %14d %12.1f %12.1f")
+                    % len % in_off % out_off % compress_lat.percentile(50) % uncompress_lat.percentile(50)
+                    % (compress_lat.percentile(50) * 1024.0 / len) % (uncompress_lat.percentile(50) * 1024.0 / len) << std::endl;
+            }
+        }
+    }
+    std::cout << std::endl;
+}
+
+enum class profile_op {
+    compress,
+    uncompress,
+    uncompress_fast,
+};
+
+// The loop profiled in the profile mode: nothing but codec calls, with the
+// clock checked once every batch operations. Not inlined, so that it shows
+// up as the single parent of the codec in call graphs.
+template <typename Op>
+__attribute__((noinline))
+static uint64_t profile_loop(Op op, size_t batch, std::chrono::steady_clock::time_point end) {
+    uint64_t ops = 0;
+    do {
+        for (size_t i = 0; i < batch; i++) {
+            op();
+        }
+        ops += batch;
+    } while (std::chrono::steady_clock::now() < end);
+    return ops;
+}
+
+// Runs a single operation of a single compressor over the same data in a
+// tight loop for a fixed duration, with no verification or bookkeeping, so
+// that an external profiler sees only the codec's hot path.
+static void profile_test(compressor_type t, profile_op op, const temporary_buf<char>& data,
+        std::chrono::seconds duration, perf_control& perf) {
+    auto c = make_compressor(t);
+    auto len = data.size();
+    auto compressed = temporary_buf<char>(c->compress_max_size(len));
+    auto compressed_len = c->compress(data.get(), len, compressed.get(), compressed.size());
+    auto output = temporary_buf<char>(std::max(len, compressed.size()));
+
+    auto run = [&] (auto op_call) {
+        // size batches to about a millisecond, so reading the clock is negligible.
+        static constexpr int samples = 16;
+        auto sample_start = std::chrono::steady_clock::now();
+        for (auto i = 0; i < samples; i++) {
+            op_call();
+        }
+        auto per_op = (std::chrono::steady_clock::now() - sample_start) / samples;
+        auto batch = std::max<size_t>(1, std::chrono::milliseconds(1) / std::max(per_op, std::chrono::steady_clock::duration(1)));
+
+        std::cout << "profiling " << c->name() << ", chunk length: " << len << ", batch: " << batch << "...\n";
+        perf.enable();
+        auto start = std::chrono::steady_clock::now();
+        auto ops = profile_loop(op_call, batch, start + duration);
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        perf.disable();
+
+        std::cout << boost::format("%1% ops in %2$.3f s, %3$.0f ns/op, %4$.1f MB/s")
+            % ops % elapsed % (elapsed * 1e9 / ops) % (ops * len / elapsed / (1024 * 1024)) << std::endl << std::endl;
+    };
+
+    switch (op) {
+    case profile_op::compress:
+        run([&] { c->compress(data.get(), len, output.get(), output.size()); });
+        break;
+    case profile_op::uncompress:
+        run([&] { c->uncompress(compressed.get(), compressed_len, output.get(), len); });
+        break;
+    case profile_op::uncompress_fast:
+        run([&] { c->uncompress_fast(compressed.get(), compressed_len, output.get(), len); });
+        break;
+    }
+}
+
+// Compares buffer allocation policies for big chunks processed in big batches,
+// where the TLB can't cover the working set: a batch of chunks adding up to
+// batch_bytes is compressed and uncompressed as a whole, and throughput and
+// dTLB load misses per chunk (when hardware counters are available) are
+// reported for each policy.
+static void hugepages_test(compressor_type t, const std::vector<size_t>& lengths, size_t batch_bytes) {
+    struct policy {
+        const char* name;
+        alloc_policy p;
+    };
+    static const std::vector<policy> policies = {
+        { "heap", alloc_policy::heap() },
+        { "cache line", alloc_policy::cache_line_aligned() },
+        { "page", alloc_policy::page_aligned() },
+        { "2MB THP", alloc_policy::huge_page_aligned(huge_pages::madvise) },
+        { "2MB hugetlb", alloc_policy::huge_page_aligned(huge_pages::hugetlb) },
+    };
+
+    auto c = make_compressor(t);
+    auto dtlb_misses = perf_counter::dtlb_load_misses();
+    std::cout << "testing " << c->name() << " with huge pages, batch: " << batch_bytes / (1024 * 1024) << " MB"
+        << (dtlb_misses.available() ? "" : " (dTLB counters not available)") << "...\n";
+    std::cout << boost::format("%10s %12s %14s %16s %14s %16s")
+        % "length" % "policy" % "compress MB/s" % "uncompress MB/s" % "comp misses" % "uncomp misses" << std::endl;
+
+    for (auto len : lengths) {
+        auto nr_chunks = std::max<size_t>(1, batch_bytes / len);
+        auto corpus = synthetic_corpus(len);
+        auto max_compressed_len = c->compress_max_size(len);
+
+        for (auto& pol : policies) {
+            // huge pages are shared by all buffers of the batch, as a mapping
+            // per buffer would inflate the footprint up to 512 times.
+            boost::optional<arena> region;
+            std::vector<temporary_buf<char>> inputs, compressed, outputs;
+            std::vector<size_t> compressed_lens(nr_chunks);
+            try {
+                auto acquire = [&] (size_t size) {
+                    return region ? region->get(size) : temporary_buf<char>(size, pol.p);
+                };
+                if (pol.p.huge != huge_pages::no) {
+                    auto slot = [] (size_t size) { return buf_alloc::align_up(size, alloc_policy::cache_line_size); };
+                    region.emplace(nr_chunks * (2 * slot(len) + slot(max_compressed_len)), pol.p);
+                }
+                for (size_t i = 0; i < nr_chunks; i++) {
+                    inputs.push_back(acquire(len));
+                    memcpy(inputs.back().get(), corpus.get(), len);
+                    compressed.push_back(acquire(max_compressed_len));
+                    outputs.push_back(acquire(len));
+                }
+            } catch (const std::exception& e) {
+                std::cout << boost::format("%10d %12s %s") % len % pol.name % e.what() << std::endl;
+                continue;
+            }
+
+            auto measure = [&] (auto op) {
+                dtlb_misses.start();
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < nr_chunks; i++) {
+                    op(i);
+                }
+                auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                dtlb_misses.stop();
+                return std::make_pair(nr_chunks * len / elapsed / (1024 * 1024), double(dtlb_misses.read()) / nr_chunks);
+            };
+            auto comp = measure([&] (size_t i) {
+                compressed_lens[i] = c->compress(inputs[i].get(), len, compressed[i].get(), max_compressed_len);
+            });
+            auto uncomp = measure([&] (size_t i) {
+                c->uncompress(compressed[i].get(), compressed_lens[i], outputs[i].get(), len);
+            });
+            for (size_t i = 0; i < nr_chunks; i++) {
+                assert(outputs[i] == inputs[i]);
+            }
+
+            auto misses = [&] (double m) {
+                return dtlb_misses.available() ? (boost::format("%1$.1f") % m).str() : std::string("n/a");
+            };
+            std::cout << boost::format("%10d %12s %14.1f %16.1f %14s %16s")
+                % len % pol.name % comp.first % uncomp.first % misses(comp.second) % misses(uncomp.second) << std::endl;
+        }
+    }
+    std::cout << std::endl;
+}
+
+// Compresses input into a chunked compressed file (see chunked_file.hh).
+// Direct writes don't go through the I/O backend.
+static void pack_file(compressor_type t, const std::string& input, const std::string& output, size_t chunk_len,
+        io_backend& io, file_access access) {
+    static constexpr size_t read_len = 1024 * 1024;
+    auto start = std::chrono::steady_clock::now();
+    file_desc in(input, O_RDONLY);
+    chunked_writer w(output, make_compressor(t), chunk_len, access == file_access::direct ? nullptr : &io, access);
+    auto buf = temporary_buf<char>(read_len, uninitialized);
+    uint64_t pos = 0;
+    while (auto n = in.pread(buf.get(), buf.size(), pos)) {
+        w.write(byte_span(buf).first(n));
+        pos += n;
+    }
+    w.close();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << boost::format("%1%: %2% bytes -> %3% bytes in %4% chunks (ratio %5$.3f), %6$.1f MB/s with %7% I/O")
+        % output % pos % w.compressed_size() % w.info().nr_chunks()
+        % (double(pos) / std::max<uint64_t>(w.compressed_size(), 1)) % (pos / elapsed / (1024 * 1024))
+        % (access == file_access::direct ? "O_DIRECT" : io.name()) << std::endl;
+}
+
+static void unpack_file(const std::string& input, const std::string& output, io_backend& io, file_access access,
+        unsigned workers) {
+    auto start = std::chrono::steady_clock::now();
+    chunked_reader r(input, access);
+    file_desc out(output, O_WRONLY | O_CREAT | O_TRUNC);
+    r.for_each_chunk(io, [&] (size_t i, byte_span data) {
+        out.pwrite(data.data(), data.size(), uint64_t(i) * r.info().chunk_len);
+    }, workers);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << boost::format("%1%: %2% bytes uncompressed with %3%, %4$.1f MB/s with %5% I/O")
+        % output % r.size() % r.info().codec % (r.size() / elapsed / (1024 * 1024)) % io.name() << std::endl;
+}
+
+// pack_file() and unpack_file() between mappings of the files, without
+// intermediate buffers (see compress_file_mapped()).
+static void pack_file_mapped(compressor_type t, const std::string& input, const std::string& output, size_t chunk_len) {
+    auto start = std::chrono::steady_clock::now();
+    auto c = make_compressor(t);
+    auto compressed = compress_file_mapped(input, output, *c, chunk_len);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto size = file_desc(input, O_RDONLY).size();
+    std::cout << boost::format("%1%: %2% bytes -> %3% bytes (ratio %4$.3f), %5$.1f MB/s with mmap")
+        % output % size % compressed % (double(size) / std::max<uint64_t>(compressed, 1))
+        % (size / elapsed / (1024 * 1024)) << std::endl;
+}
+
+static void unpack_file_mapped(const std::string& input, const std::string& output) {
+    auto start = std::chrono::steady_clock::now();
+    auto size = uncompress_file_mapped(input, output);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << boost::format("%1%: %2% bytes uncompressed, %3$.1f MB/s with mmap")
+        % output % size % (size / elapsed / (1024 * 1024)) << std::endl;
+}
+
+// Writes the corpus as a chunked compressed file for every chunk length, then
+// reads it back whole and at random offsets. Small chunks make random reads
+// cheap, big ones compress better and stream faster. The file is in the page
+// cache, so this measures the format and the codecs, not the disk.
+static void container_test(compressor_type t, const precise_timer& timer, const temporary_buf<char>& corpus,
+        const std::vector<size_t>& lengths, const std::string& path) {
+    static constexpr size_t random_reads = 10000;
+    static constexpr size_t random_read_len = 4096;
+    std::cout << "testing " << make_compressor(t)->name() << " chunked files of " << corpus.size() << " bytes...\n";
+    std::cout << boost::format("%-9s %8s %14s %13s %15s %15s") % "chunk" % "ratio" % "write MB/s" % "read MB/s"
+        % "4K read p50 ns" % "4K read p99 ns" << std::endl;
+
+    std::mt19937_64 rng(0);
+    auto out = temporary_buf<char>(std::max(corpus.size(), random_read_len), uninitialized);
+    for (auto chunk_len : lengths) {
+        auto start = std::chrono::steady_clock::now();
+        chunked_writer w(path, make_compressor(t), chunk_len);
+        w.write(corpus);
+        w.close();
+        auto write_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        {   // the same data, handed over in fragments straddling chunks, makes the same file.
+            chained_buf chain;
+            auto fragment_len = chunk_len * 3 / 2 + 1;
+            for (size_t pos = 0; pos < corpus.size(); pos += fragment_len) {
+                auto fragment = temporary_buf<char>(std::min(fragment_len, corpus.size() - pos), uninitialized);
+                memcpy(fragment.get(), corpus.get() + pos, fragment.size());
+                chain.append(std::move(fragment));
+            }
+            chunked_writer chained_w(path + ".chained", make_compressor(t), chunk_len);
+            chained_w.write(chain);
+            chained_w.close();
+            ::unlink((path + ".chained").c_str());
+            assert(chained_w.compressed_size() == w.compressed_size());
+            assert(chained_w.info().checksums == w.info().checksums);
+        }
+
+        chunked_reader r(path);
+        start = std::chrono::steady_clock::now();
+        auto n = r.read(0, out);
+        auto read_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        assert(n == corpus.size());
+        assert(memcmp(out.get(), corpus.get(), n) == 0);
+
+        latency_histogram lat;
+        std::uniform_int_distribution<uint64_t> offset(0, corpus.size() - std::min(corpus.size(), random_read_len));
+        for (size_t i = 0; i < random_reads; i++) {
+            auto pos = offset(rng);
+            lat.record(timer.time([&] {
+                n = r.read(pos, mutable_byte_span(out).first(random_read_len));
+            }));
+            assert(memcmp(out.get(), corpus.get() + pos, n) == 0);
+        }
+
+        std::cout << boost::format("%-9d %8.3f %14.1f %13.1f %15d %15d") % chunk_len
+            % (double(corpus.size()) / std::max<uint64_t>(w.compressed_size(), 1))
+            % (corpus.size() / write_time / (1024 * 1024)) % (corpus.size() / read_time / (1024 * 1024))
+            % lat.percentile(50) % lat.percentile(99) << std::endl;
+    }
+    ::unlink(path.c_str());
+    std::cout << std::endl;
+}
+
+// Memory and lookup cost of the chunk offsets of a file of nr_chunks chunks of
+// chunk_len bytes, kept in a plain vector or Elias-Fano encoded. Compressed
+// lengths are random, between a quarter of the chunk and all of it. Lookups
+// are timed in bulk, as one takes less than the timer overhead.
+static void index_test(size_t nr_chunks, size_t chunk_len) {
+    static constexpr size_t lookups = 4 * 1024 * 1024;
+    std::cout << "testing offset index of " << nr_chunks << " chunks of " << chunk_len << " bytes...\n";
+
+    std::mt19937_64 rng(0);
+    std::uniform_int_distribution<uint64_t> compressed_len(chunk_len / 4, chunk_len);
+    std::vector<uint64_t> offsets;
+    offsets.reserve(nr_chunks + 1);
+    uint64_t pos = 0;
+    for (size_t i = 0; i < nr_chunks; i++) {
+        offsets.push_back(pos);
+        pos += compressed_len(rng);
+    }
+    offsets.push_back(pos);
+    elias_fano ef(offsets);
+    for (size_t i = 0; i < nr_chunks; i++) {
+        auto range = ef.pair_at(i);
+        assert(range.first == offsets[i] && range.second == offsets[i + 1]);
+    }
+
+    std::uniform_int_distribution<size_t> chunk(0, nr_chunks - 1);
+    std::vector<size_t> indexes(lookups);
+    for (auto& i : indexes) {
+        i = chunk(rng);
+    }
+    auto time_lookups = [&] (auto lookup) {
+        uint64_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (auto i : indexes) {
+            sum += lookup(i);
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        // keeps the lookups from being optimized away.
+        asm volatile("" : : "r"(sum));
+        return elapsed / lookups;
+    };
+    auto vector_offset = time_lookups([&] (size_t i) { return offsets[i]; });
+    auto vector_range = time_lookups([&] (size_t i) { return offsets[i + 1] - offsets[i]; });
+    auto ef_offset = time_lookups([&] (size_t i) { return ef[i]; });
+    auto ef_range = time_lookups([&] (size_t i) { auto r = ef.pair_at(i); return r.second - r.first; });
+
+    std::cout << boost::format("%-12s %14s %16s %24s") % "index" % "bytes/chunk" % "offset ns" % "offset and length ns" << std::endl;
+    std::cout << boost::format("%-12s %14.2f %16.1f %24.1f") % "vector"
+        % (double(offsets.capacity() * sizeof(uint64_t)) / nr_chunks) % vector_offset % vector_range << std::endl;
+    std::cout << boost::format("%-12s %14.2f %16.1f %24.1f") % "elias-fano"
+        % (double(ef.memory_bytes()) / nr_chunks) % ef_offset % ef_range << std::endl;
+    std::cout << std::endl;
+}
+
+// Drops the file from the page cache, so that it's next read from the disk.
+static void evict_from_page_cache(const std::string& path) {
+    file_desc f(path, O_RDONLY);
+    if (::fdatasync(f.fd()) < 0 || ::posix_fadvise(f.fd(), 0, 0, POSIX_FADV_DONTNEED) != 0) {
+        throw std::runtime_error("cannot evict " + path + " from the page cache");
+    }
+}
+
+// Writes the corpus as a chunked file and reads it back from the disk, with
+// pread/pwrite and with io_uring, io_depth requests in flight, uncompressing
+// on the reading thread and then on that many workers. The read interval is
+// the time between two uncompressed chunks being handed over, the latency
+// seen by a consumer of the file.
+static void io_test(compressor_type t, const temporary_buf<char>& corpus, size_t chunk_len, unsigned io_depth,
+        unsigned workers, const std::string& path) {
+    std::cout << "testing " << make_compressor(t)->name() << " chunked file I/O, chunk length: " << chunk_len
+        << ", depth: " << io_depth << "...\n";
+    std::cout << boost::format("%-9s %8s %11s %11s %18s %18s") % "backend" % "workers" % "write MB/s" % "read MB/s"
+        % "read interval p50" % "read interval p99" << std::endl;
+    std::vector<std::pair<const char*, unsigned>> runs;
+    for (auto backend : { "sync", "uring" }) {
+        runs.emplace_back(backend, 0);
+        if (workers) {
+            runs.emplace_back(backend, workers);
+        }
+    }
+    for (auto& run : runs) {
+        auto io = make_io_backend(run.first, io_depth);
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            chunked_writer w(path, make_compressor(t), chunk_len, io.get());
+            w.write(corpus);
+            w.close();
+        }
+        auto write_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        evict_from_page_cache(path);
+
+        chunked_reader r(path);
+        latency_histogram interval;
+        std::mutex interval_mutex;
+        start = std::chrono::steady_clock::now();
+        auto last = start;
+        r.for_each_chunk(*io, [&] (size_t i, byte_span data) {
+            assert(memcmp(data.data(), corpus.get() + i * chunk_len, data.size()) == 0);
+            // workers hand chunks over concurrently.
+            std::lock_guard<std::mutex> lock(interval_mutex);
+            auto now = std::chrono::steady_clock::now();
+            interval.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+            last = now;
+        }, run.second);
+        auto read_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << boost::format("%-9s %8d %11.1f %11.1f %15d ns %15d ns") % io->name() % run.second
+            % (corpus.size() / write_time / (1024 * 1024)) % (corpus.size() / read_time / (1024 * 1024))
+            % interval.percentile(50) % interval.percentile(99) << std::endl;
+    }
+    ::unlink(path.c_str());
+    std::cout << std::endl;
+}
+
+// Bytes of the file that are in the page cache.
+static uint64_t resident_bytes(const std::string& path) {
+    file_desc f(path, O_RDONLY);
+    auto size = f.size();
+    if (!size) {
+        return 0;
+    }
+    auto p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, f.fd(), 0);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path);
+    }
+    std::vector<unsigned char> pages((size + alloc_policy::page_size - 1) / alloc_policy::page_size);
+    auto ret = ::mincore(p, size, pages.data());
+    ::munmap(p, size);
+    if (ret < 0) {
+        throw std::runtime_error("mincore failed on " + path);
+    }
+    return std::count_if(pages.begin(), pages.end(), [] (unsigned char c) { return c & 1; }) * alloc_policy::page_size;
+}
+
+static double cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+struct fault_counts {
+    long minor;
+    long major;
+};
+
+static fault_counts page_faults() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return fault_counts{ru.ru_minflt, ru.ru_majflt};
+}
+
+// Writes and reads the corpus as a chunked file through the page cache and
+// with O_DIRECT, starting with the file out of the cache, and reports how much
+// of the file ends up cached and the CPU time spent, compression included.
+static void direct_test(compressor_type t, const temporary_buf<char>& corpus, size_t chunk_len, const std::string& path) {
+    std::cout << "testing " << make_compressor(t)->name() << " chunked file page cache use, chunk length: "
+        << chunk_len << "...\n";
+    std::cout << boost::format("%-9s %11s %11s %14s %11s %11s %14s") % "access" % "write MB/s" % "write cpu s"
+        % "cached kB" % "read MB/s" % "read cpu s" % "cached kB" << std::endl;
+    for (auto access : { file_access::buffered, file_access::direct }) {
+        auto start = std::chrono::steady_clock::now();
+        auto cpu = cpu_seconds();
+        {
+            chunked_writer w(path, make_compressor(t), chunk_len, nullptr, access);
+            w.write(corpus);
+            w.close();
+        }
+        auto write_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto write_cpu = cpu_seconds() - cpu;
+        auto cached_after_write = resident_bytes(path);
+        evict_from_page_cache(path);
+
+        start = std::chrono::steady_clock::now();
+        cpu = cpu_seconds();
+        uint64_t n = 0;
+        {
+            chunked_reader r(path, access);
+            sync_io io(1);
+            r.for_each_chunk(io, [&] (size_t i, byte_span data) {
+                assert(memcmp(data.data(), corpus.get() + i * chunk_len, data.size()) == 0);
+                n += data.size();
+            });
+        }
+        auto read_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto read_cpu = cpu_seconds() - cpu;
+        assert(n == corpus.size());
+
+        std::cout << boost::format("%-9s %11.1f %11.3f %14d %11.1f %11.3f %14d")
+            % (access == file_access::direct ? "direct" : "buffered")
+            % (corpus.size() / write_time / (1024 * 1024)) % write_cpu % (cached_after_write / 1024)
+            % (corpus.size() / read_time / (1024 * 1024)) % read_cpu % (resident_bytes(path) / 1024) << std::endl;
+    }
+    ::unlink(path.c_str());
+    std::cout << std::endl;
+}
+
+// Compares two files through mappings, a piece at a time, dropping the pages
+// compared so that files bigger than memory can be compared too.
+static bool same_contents(const std::string& a, const std::string& b) {
+    static constexpr size_t piece_len = 64 * 1024 * 1024;
+    auto ma = map_file(a, access_hint::sequential);
+    auto mb = map_file(b, access_hint::sequential);
+    if (ma.size() != mb.size()) {
+        return false;
+    }
+    for (size_t pos = 0; pos < ma.size(); pos += piece_len) {
+        auto len = std::min(piece_len, ma.size() - pos);
+        if (memcmp(ma.get() + pos, mb.get() + pos, len) != 0) {
+            return false;
+        }
+        release_consumed(ma, pos, len);
+        release_consumed(mb, pos, len);
+    }
+    return true;
+}
+
+// Packs and unpacks the input file with read()/write() and with mappings of
+// the files, starting with the input out of the page cache, and reports the
+// CPU time and page faults it takes. Files bigger than memory show whether
+// each path keeps streaming once the page cache is full of dirty pages. The
+// mapped container must come out identical to the written one, and both must
+// unpack to the input.
+static void mapped_test(compressor_type t, const std::string& input, size_t chunk_len, const std::string& path) {
+    auto unpacked = path + ".unpacked";
+    auto written = path + ".written";
+    auto size = file_desc(input, O_RDONLY).size();
+    std::cout << "testing " << make_compressor(t)->name() << " packing of " << input << " (" << size
+        << " bytes), chunk length: " << chunk_len << "...\n";
+    std::cout << boost::format("%-7s %-7s %11s %9s %12s %12s") % "path" % "op" % "MB/s" % "cpu s"
+        % "minor faults" % "major faults" << std::endl;
+    for (auto mapped : { false, true }) {
+        auto report = [&] (const char* op, auto&& fn) {
+            evict_from_page_cache(op == std::string("pack") ? input : path);
+            auto start = std::chrono::steady_clock::now();
+            auto cpu = cpu_seconds();
+            auto faults = page_faults();
+            fn();
+            auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            auto now = page_faults();
+            std::cout << boost::format("%-7s %-7s %11.1f %9.3f %12d %12d") % (mapped ? "mmap" : "read") % op
+                % (size / elapsed / (1024 * 1024)) % (cpu_seconds() - cpu) % (now.minor - faults.minor)
+                % (now.major - faults.major) << std::endl;
+        };
+        report("pack", [&] {
+            if (mapped) {
+                auto c = make_compressor(t);
+                compress_file_mapped(input, path, *c, chunk_len);
+            } else {
+                sync_io io(1);
+                chunked_writer w(path, make_compressor(t), chunk_len, &io);
+                file_desc in(input, O_RDONLY);
+                auto buf = temporary_buf<char>(1024 * 1024, uninitialized);
+                uint64_t pos = 0;
+                while (auto n = in.pread(buf.get(), buf.size(), pos)) {
+                    w.write(byte_span(buf).first(n));
+                    pos += n;
+                }
+                w.close();
+            }
+        });
+        report("unpack", [&] {
+            if (mapped) {
+                uncompress_file_mapped(path, unpacked);
+            } else {
+                sync_io io(1);
+                chunked_reader r(path);
+                file_desc out(unpacked, O_WRONLY | O_CREAT | O_TRUNC);
+                r.for_each_chunk(io, [&] (size_t i, byte_span data) {
+                    out.pwrite(data.data(), data.size(), uint64_t(i) * r.info().chunk_len);
+                });
+            }
+        });
+        assert(same_contents(unpacked, input));
+        if (mapped) {
+            assert(same_contents(path, written));
+        } else if (::rename(path.c_str(), written.c_str()) < 0) {
+            throw std::runtime_error("cannot rename " + path + ": " + strerror(errno));
+        }
+    }
+    ::unlink(path.c_str());
+    ::unlink(written.c_str());
+    ::unlink(unpacked.c_str());
+    std::cout << std::endl;
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+
+    bpo::options_description desc("options");
+    desc.add_options()
+        ("help", "show this help message")
+        ("mode", bpo::value<std::string>()->default_value("test"),
+            "test: correctness and single-threaded latency; threads: multi-threaded scaling; "
+            "memory: allocations and memory footprint per operation; "
+            "sweep: speed/ratio of every compressor and level over a corpus; "
+            "soak: mixed load over time, reported per interval; "
+            "replay: operations recorded in a trace (see trace.hh); "
+            "alignment: latency by chunk length and buffer alignment; "
+            "profile: one operation in a tight loop, for external profilers; "
+            "hugepages: buffer alignment and huge page policies on big batches; "
+            "batch: heap vs pool vs arena vs THP vs NUMA-local scratch buffers; "
+            "stream: compress the --corpus file once from a memory mapping; "
+            "container: write and read chunked compressed files (see chunked_file.hh) of the corpus; "
+            "pack: compress --input into the chunked file --output; unpack: the reverse; "
+            "index: memory and lookup cost of chunk offset indexes; "
+            "io: chunked file I/O with pread/pwrite vs io_uring; "
+            "direct: chunked file I/O through the page cache vs O_DIRECT; "
+            "mapped: packing and unpacking --input with read/write vs mmap; "
+            "zalloc: contention on the allocator of zlib's state, malloc vs slab, on 1 to --threads threads")
+        ("compressor", bpo::value<std::vector<std::string>>()->multitoken(),
+            "compressors to run (lz4, deflate, snappy); defaults to all")
+        ("threads", bpo::value<unsigned>()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+            "highest thread count for the threads and zalloc modes")
+        ("workers", bpo::value<unsigned>()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+            "uncompression threads for the io mode and unpack; 0 uncompresses on the reading thread")
+        ("chunk-lengths", bpo::value<std::vector<size_t>>()->multitoken(),
+            "chunk lengths for the test, memory, sweep and alignment modes")
+        ("chunk-range", bpo::value<std::string>(), "chunk lengths as min:max:step, instead of --chunk-lengths")
+        ("offsets", bpo::value<std::vector<size_t>>()->multitoken(),
+            "buffer offsets from a page boundary for the alignment mode; defaults to 0 1 8 32 63 4032")
+        ("chunk-length", bpo::value<size_t>()->default_value(4*1024), "chunk length for the threads, soak, profile, batch and stream modes")
+        ("duration", bpo::value<unsigned>()->default_value(5),
+            "seconds to run each thread count (threads and zalloc modes) or each compressor (soak and profile modes) for")
+        ("interval", bpo::value<unsigned>()->default_value(1),
+            "seconds between reports in the soak mode; the last report covers what's left of --duration")
+        ("read-ratio", bpo::value<double>()->default_value(0.5), "fraction of uncompressions in the soak mode")
+        ("op", bpo::value<std::string>()->default_value("uncompress"),
+            "operation for the profile mode: compress, uncompress or uncompress_fast")
+        ("data", bpo::value<std::string>()->default_value("text"),
+            "data for the profile mode: text or random; --corpus takes precedence")
+        ("perf-ctl", bpo::value<std::string>()->default_value(""), "perf --control fifo to enable/disable sampling through")
+        ("perf-ack", bpo::value<std::string>()->default_value(""), "perf --control ack fifo")
+        ("batch-size", bpo::value<size_t>()->default_value(64), "MB of chunks per batch in the hugepages mode")
+        ("batch-chunks", bpo::value<size_t>()->default_value(64), "chunks per batch in the batch mode")
+        ("trace", bpo::value<std::string>(), "trace to replay in the replay mode")
+        ("loop", bpo::value<std::string>()->default_value("open"), "replay mode loop: open or closed")
+        ("speed", bpo::value<double>()->default_value(1.0), "replay speed relative to the recorded arrival times")
+        ("batch", bpo::value<unsigned>()->default_value(1),
+            "operations timed together in the test mode, with the latency being their average")
+        ("phases", "in the test mode, also report buffer acquire, verify and release times")
+        ("zero-outputs", "in the test mode, zero output buffers before uncompressing into them")
+        ("zlib-alloc", bpo::value<std::string>()->default_value("malloc"), "where zlib allocates its state: malloc or slab")
+        ("pool", "take per-operation buffers from a buffer pool, in the test and soak modes")
+        ("guard-pages", "end per-operation buffers against a PROT_NONE page, so that codec overruns fault, "
+            "in the test and soak modes")
+        ("corpus", bpo::value<std::string>(), "file to use as data for the sweep and replay modes; defaults to synthetic text")
+        ("mmap", "map the --corpus file instead of reading it into memory; "
+            "in the pack and unpack modes, compress and uncompress between file mappings")
+        ("corpus-size", bpo::value<size_t>()->default_value(8*1024*1024), "size of the synthetic corpus")
+        ("index-chunks", bpo::value<size_t>()->default_value(4*1024*1024), "chunks of the index mode")
+        ("io", bpo::value<std::string>()->default_value("sync"),
+            "I/O backend of the pack and unpack modes: sync (pread/pwrite) or uring (io_uring, falling back to sync)")
+        ("direct", "chunked file I/O with O_DIRECT in the pack and unpack modes")
+        ("io-depth", bpo::value<unsigned>()->default_value(32), "chunk reads or writes in flight with an I/O backend")
+        ("input", bpo::value<std::string>(), "input file of the pack, unpack and mapped modes")
+        ("output", bpo::value<std::string>(),
+            "output file of the pack and unpack modes, scratch file of the container, io, direct and mapped modes")
+        ;
+
+    bpo::variables_map vm;
+    try {
+        bpo::store(bpo::parse_command_line(ac, av, desc), vm);
+        bpo::notify(vm);
+    } catch (const bpo::error& e) {
+        std::cerr << e.what() << "\n" << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    std::vector<compressor_type> types;
+    try {
+        if (vm.count("compressor")) {
+            for (auto& name : vm["compressor"].as<std::vector<std::string>>()) {
+                types.push_back(compressor_type_from_name(name));
+            }
+        } else {
+            types = all_compressor_types;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    bool custom_chunk_lengths = vm.count("chunk-lengths") || vm.count("chunk-range");
+    try {
+        if (vm.count("chunk-range")) {
+            chunk_lengths = parse_chunk_range(vm["chunk-range"].as<std::string>());
+        } else if (vm.count("chunk-lengths")) {
+            chunk_lengths = vm["chunk-lengths"].as<std::vector<size_t>>();
+        }
+        if (std::count(chunk_lengths.begin(), chunk_lengths.end(), 0)) {
+            throw std::runtime_error("chunk lengths must be positive");
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    auto zlib_alloc = vm["zlib-alloc"].as<std::string>();
+    if (zlib_alloc == "slab") {
+        deflate_compressor::allocator() = zlib_allocator::slab;
+    } else if (zlib_alloc != "malloc") {
+        std::cerr << "unknown zlib allocator: " << zlib_alloc << std::endl;
+        return 1;
+    }
+    if (vm.count("pool") && vm.count("guard-pages")) {
+        std::cerr << "--pool and --guard-pages are exclusive" << std::endl;
+        return 1;
+    }
+    if (vm.count("pool")) {
+        buf_source = &buffer_pool::resource();
+    }
+    static guard_page_resource guarded;
+    if (vm.count("guard-pages")) {
+        buf_source = &guarded;
+    }
+
+    precise_timer timer;
+    std::cout << boost::format("timer: %1%, %2$.3f ticks/ns, overhead: %3$.1f ns")
+        % timer.source() % timer.ticks_per_ns() % timer.overhead_ns() << std::endl << std::endl;
+
+    auto mode = vm["mode"].as<std::string>();
+    if ((mode == "io" || mode == "pack" || mode == "unpack") && !vm["io-depth"].as<unsigned>()) {
+        std::cerr << "--io-depth must be positive" << std::endl;
+        return 1;
+    }
+    // chunked files store the chunk length in 32 bits.
+    if (mode == "container" || mode == "io" || mode == "direct" || mode == "mapped" || mode == "pack") {
+        auto lengths = mode == "container" ? chunk_lengths : std::vector<size_t>{ vm["chunk-length"].as<size_t>() };
+        try {
+            for (auto len : lengths) {
+                compression_info::checked_chunk_len(len);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    // only the modes reporting heap activity pay for counting it.
+    if (mode == "memory" || mode == "threads" || mode == "batch" || mode == "soak") {
+        enable_alloc_accounting();
+    }
+    if (mode == "test") {
+        latency_options opts;
+        opts.batch = std::max(1u, vm["batch"].as<unsigned>());
+        opts.phases = vm.count("phases");
+        opts.zero_outputs = vm.count("zero-outputs");
+        chained_buf_test();
+        for (auto t : types) {
+            compressor_test(t, timer, opts);
+        }
+    } else if (mode == "threads") {
+        auto max_threads = std::max(1u, vm["threads"].as<unsigned>());
+        auto chunk_len = vm["chunk-length"].as<size_t>();
+        auto duration = std::chrono::seconds(vm["duration"].as<unsigned>());
+        for (auto t : types) {
+            try {
+                threads_test(t, timer, max_threads, chunk_len, duration);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "zalloc") {
+        try {
+            zlib_alloc_test(timer, std::max(1u, vm["threads"].as<unsigned>()),
+                std::chrono::seconds(vm["duration"].as<unsigned>()));
+        } catch (const std::exception& e) {
+            std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+        }
+    } else if (mode == "memory") {
+        for (auto t : types) {
+            try {
+                memory_test(t, timer);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "soak") {
+        soak_options opts;
+        opts.chunk_len = vm["chunk-length"].as<size_t>();
+        opts.duration = std::chrono::seconds(vm["duration"].as<unsigned>());
+        opts.interval = std::chrono::seconds(std::max(1u, vm["interval"].as<unsigned>()));
+        opts.read_ratio = vm["read-ratio"].as<double>();
+        for (auto t : types) {
+            try {
+                soak_test(t, timer, opts);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "replay") {
+        try {
+            if (!vm.count("trace")) {
+                throw std::runtime_error("replay mode needs --trace");
+            }
+            auto trace = load_trace(vm["trace"].as<std::string>());
+            if (trace.empty()) {
+                throw std::runtime_error("trace is empty");
+            }
+            size_t max_size = 0;
+            for (auto& r : trace) {
+                max_size = std::max(max_size, r.size);
+            }
+            auto corpus = vm.count("corpus") ? load_corpus(vm["corpus"].as<std::string>(), vm.count("mmap"))
+                                             : synthetic_corpus(std::max(max_size, vm["corpus-size"].as<size_t>()));
+            replay_options opts;
+            auto loop = vm["loop"].as<std::string>();
+            if (loop == "open") {
+                opts.mode = replay_mode::open_loop;
+            } else if (loop == "closed") {
+                opts.mode = replay_mode::closed_loop;
+            } else {
+                throw std::runtime_error("unknown loop: " + loop);
+            }
+            opts.speed = vm["speed"].as<double>();
+            if (opts.speed <= 0) {
+                throw std::runtime_error("speed must be positive");
+            }
+            for (auto t : types) {
+                replay_test(t, timer, trace, corpus, opts);
+            }
+        } catch (const std::exception& e) {
+            std::cout << "Caught exception: " << e.what() << std::endl;
+            return 1;
+        }
+    } else if (mode == "alignment") {
+        // around block size thresholds, and off powers of two, by default.
+        auto lengths = custom_chunk_lengths ? chunk_lengths
+            : std::vector<size_t>{ 1000, 4000, 4096, 4097, 16000, 16384, 65535, 65536, 100000, 262144 };
+        auto offsets = vm.count("offsets") ? vm["offsets"].as<std::vector<size_t>>()
+            : std::vector<size_t>{ 0, 1, 8, 32, 63, 4032 };
+        for (auto t : types) {
+            try {
+                alignment_test(t, timer, lengths, offsets);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "profile") {
+        try {
+            auto op_name = vm["op"].as<std::string>();
+            profile_op op;
+            if (op_name == "compress") {
+                op = profile_op::compress;
+            } else if (op_name == "uncompress") {
+                op = profile_op::uncompress;
+            } else if (op_name == "uncompress_fast") {
+                op = profile_op::uncompress_fast;
+            } else {
+                throw std::runtime_error("unknown operation: " + op_name);
+            }
+
+            auto chunk_len = vm["chunk-length"].as<size_t>();
+            auto data_name = vm["data"].as<std::string>();
+            auto data = temporary_buf<char>(chunk_len, uninitialized);
+            if (vm.count("corpus")) {
+                auto corpus = load_corpus(vm["corpus"].as<std::string>(), vm.count("mmap"));
+                if (corpus.size() < chunk_len) {
+                    throw std::runtime_error("corpus is smaller than the chunk length");
+                }
+                memcpy(data.get(), corpus.get(), chunk_len);
+            } else if (data_name == "text") {
+                auto corpus = synthetic_corpus(chunk_len);
+                memcpy(data.get(), corpus.get(), chunk_len);
+            } else if (data_name == "random") {
+                auto random = temporary_buf<char>::random(chunk_len);
+                memcpy(data.get(), random.get(), chunk_len);
+            } else {
+                throw std::runtime_error("unknown data: " + data_name);
+            }
+
+            perf_control perf(vm["perf-ctl"].as<std::string>(), vm["perf-ack"].as<std::string>());
+            auto duration = std::chrono::seconds(vm["duration"].as<unsigned>());
+            for (auto t : types) {
+                try {
+                    profile_test(t, op, data, duration, perf);
+                } catch (const std::exception& e) {
+                    std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cout << "Caught exception: " << e.what() << std::endl;
+            return 1;
+        }
+    } else if (mode == "batch") {
+        auto chunk_len = vm["chunk-length"].as<size_t>();
+        auto batch_size = std::max<size_t>(1, vm["batch-chunks"].as<size_t>());
+        for (auto t : types) {
+            try {
+                batch_test(t, timer, chunk_len, batch_size);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "stream") {
+        if (!vm.count("corpus")) {
+            std::cerr << "stream mode needs --corpus" << std::endl;
+            return 1;
+        }
+        auto chunk_len = vm["chunk-length"].as<size_t>();
+        for (auto t : types) {
+            try {
+                stream_test(t, vm["corpus"].as<std::string>(), chunk_len);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "container") {
+        auto corpus = vm.count("corpus") ? load_corpus(vm["corpus"].as<std::string>(), vm.count("mmap"))
+            : synthetic_corpus(vm["corpus-size"].as<size_t>());
+        auto path = vm.count("output") ? vm["output"].as<std::string>() : std::string("compressors_test.chunked");
+        for (auto t : types) {
+            try {
+                container_test(t, timer, corpus, chunk_lengths, path);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "index") {
+        if (!vm["index-chunks"].as<size_t>()) {
+            std::cerr << "--index-chunks must be positive" << std::endl;
+            return 1;
+        }
+        try {
+            for (auto chunk_len : chunk_lengths) {
+                index_test(vm["index-chunks"].as<size_t>(), chunk_len);
+            }
+        } catch (const std::exception& e) {
+            std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+        }
+    } else if (mode == "io") {
+        auto corpus = vm.count("corpus") ? load_corpus(vm["corpus"].as<std::string>(), vm.count("mmap"))
+            : synthetic_corpus(vm["corpus-size"].as<size_t>());
+        auto path = vm.count("output") ? vm["output"].as<std::string>() : std::string("compressors_test.chunked");
+        for (auto t : types) {
+            try {
+                io_test(t, corpus, vm["chunk-length"].as<size_t>(), vm["io-depth"].as<unsigned>(),
+                    vm["workers"].as<unsigned>(), path);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "direct") {
+        auto corpus = vm.count("corpus") ? load_corpus(vm["corpus"].as<std::string>(), vm.count("mmap"))
+            : synthetic_corpus(vm["corpus-size"].as<size_t>());
+        auto path = vm.count("output") ? vm["output"].as<std::string>() : std::string("compressors_test.chunked");
+        for (auto t : types) {
+            try {
+                direct_test(t, corpus, vm["chunk-length"].as<size_t>(), path);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "mapped") {
+        if (!vm.count("input")) {
+            std::cerr << "mapped mode needs --input" << std::endl;
+            return 1;
+        }
+        auto path = vm.count("output") ? vm["output"].as<std::string>() : std::string("compressors_test.chunked");
+        for (auto t : types) {
+            try {
+                mapped_test(t, vm["input"].as<std::string>(), vm["chunk-length"].as<size_t>(), path);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "pack" || mode == "unpack") {
+        if (!vm.count("input") || !vm.count("output")) {
+            std::cerr << mode << " mode needs --input and --output" << std::endl;
+            return 1;
+        }
+        try {
+            auto io = make_io_backend(vm["io"].as<std::string>(), vm["io-depth"].as<unsigned>());
+            auto access = vm.count("direct") ? file_access::direct : file_access::buffered;
+            if (vm.count("mmap")) {
+                if (vm.count("direct")) {
+                    throw std::runtime_error("--mmap and --direct are mutually exclusive");
+                }
+                if (mode == "pack") {
+                    pack_file_mapped(types.front(), vm["input"].as<std::string>(), vm["output"].as<std::string>(),
+                        vm["chunk-length"].as<size_t>());
+                } else {
+                    unpack_file_mapped(vm["input"].as<std::string>(), vm["output"].as<std::string>());
+                }
+            } else if (mode == "pack") {
+                pack_file(types.front(), vm["input"].as<std::string>(), vm["output"].as<std::string>(),
+                    vm["chunk-length"].as<size_t>(), *io, access);
+            } else {
+                unpack_file(vm["input"].as<std::string>(), vm["output"].as<std::string>(), *io, access,
+                    vm["workers"].as<unsigned>());
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else if (mode == "hugepages") {
+        auto lengths = custom_chunk_lengths ? chunk_lengths
+            : std::vector<size_t>{ 256*1024, 1024*1024, 4*1024*1024 };
+        auto batch_bytes = vm["batch-size"].as<size_t>() * 1024 * 1024;
+        for (auto t : types) {
+            try {
+                hugepages_test(t, lengths, batch_bytes);
+            } catch (const std::exception& e) {
+                std::cout << "Caught exception: " << e.what() << std::endl << std::endl;
+            }
+        }
+    } else if (mode == "sweep") {
+        try {
+            auto corpus = vm.count("corpus") ? load_corpus(vm["corpus"].as<std::string>(), vm.count("mmap"))
+                                             : synthetic_corpus(vm["corpus-size"].as<size_t>());
+            sweep_test(types, corpus);
+        } catch (const std::exception& e) {
+            std::cout << "Caught exception: " << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        std::cerr << "unknown mode: " << mode << "\n" << desc << std::endl;
+        return 1;
+    }
 
     return 0;
 }
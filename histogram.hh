@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+
+// Log-linear histogram for latencies: values are grouped by power of two, and
+// each power of two is split into sub_buckets linear buckets, so the relative
+// error is bounded by 1/sub_buckets at any magnitude. Recording is a couple of
+// instructions and histograms can be merged, so each thread can keep its own
+// and have them combined after the run.
+class latency_histogram {
+    static constexpr unsigned sub_bucket_bits = 5;
+    static constexpr unsigned sub_buckets = 1u << sub_bucket_bits;
+    static constexpr unsigned bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    std::array<uint64_t, bucket_count> _counts{};
+    uint64_t _count = 0;
+    uint64_t _total = 0;
+    uint64_t _min = std::numeric_limits<uint64_t>::max();
+    uint64_t _max = 0;
+private:
+    static unsigned index_of(uint64_t v) {
+        if (v < sub_buckets) {
+            return v;
+        }
+        unsigned shift = 63 - __builtin_clzll(v) - sub_bucket_bits;
+        return (shift + 1) * sub_buckets + ((v >> shift) - sub_buckets);
+    }
+    // highest value that maps to bucket idx.
+    static uint64_t highest_value_of(unsigned idx) {
+        if (idx < sub_buckets) {
+            return idx;
+        }
+        unsigned shift = idx / sub_buckets - 1;
+        uint64_t lowest = uint64_t(sub_buckets + idx % sub_buckets) << shift;
+        return lowest + ((uint64_t(1) << shift) - 1);
+    }
+public:
+    void record(uint64_t v) {
+        _counts[index_of(v)]++;
+        _count++;
+        _total += v;
+        _min = std::min(_min, v);
+        _max = std::max(_max, v);
+    }
+    void merge(const latency_histogram& other) {
+        for (unsigned i = 0; i < bucket_count; i++) {
+            _counts[i] += other._counts[i];
+        }
+        _count += other._count;
+        _total += other._total;
+        _min = std::min(_min, other._min);
+        _max = std::max(_max, other._max);
+    }
+    void reset() {
+        *this = latency_histogram();
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+    uint64_t total() const {
+        return _total;
+    }
+    uint64_t min() const {
+        return _count ? _min : 0;
+    }
+    uint64_t max() const {
+        return _max;
+    }
+    uint64_t mean() const {
+        return _count ? _total / _count : 0;
+    }
+    // p is in the range [0, 100].
+    uint64_t percentile(double p) const {
+        if (!_count) {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, uint64_t(p / 100.0 * _count + 0.5));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < bucket_count; i++) {
+            seen += _counts[i];
+            if (seen >= target) {
+                return std::min(std::max(highest_value_of(i), min()), _max);
+            }
+        }
+        return _max;
+    }
+};
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Positional reads and writes with many requests in flight. Requests are
+// queued with submit() and their results collected with wait(), tagged with
+// what the caller passed in. Results are byte counts or -errno, and may be
+// short.
+//
+// uring_io keeps up to depth() requests in the kernel with io_uring, which is
+// driven through raw syscalls so that liburing isn't needed: submit() only
+// fills a ring entry, and wait() submits everything queued and reaps
+// completions in one syscall. sync_io does each request with pread/pwrite
+// right in submit(), for kernels without io_uring (or where it's disabled, or
+// predates IORING_OP_READ/WRITE, added in 5.6). Depths must be positive.
+struct io_request {
+    bool write = false;
+    int fd = -1;
+    char* buf = nullptr;
+    size_t len = 0;
+    uint64_t pos = 0;
+    uint64_t tag = 0;
+};
+
+struct io_completion {
+    uint64_t tag;
+    int64_t result;
+};
+
+class io_backend {
+protected:
+    size_t _in_flight = 0;
+public:
+    virtual ~io_backend() {}
+    virtual const char* name() const = 0;
+    // requests that can be in flight at once.
+    virtual size_t depth() const = 0;
+    // must not be called with depth() requests in flight.
+    virtual void submit(const io_request& r) = 0;
+    // Waits until at least min requests complete and appends the completions
+    // to out, along with any other that is ready.
+    virtual void wait(size_t min, std::vector<io_completion>& out) = 0;
+
+    size_t in_flight() const {
+        return _in_flight;
+    }
+    // waits for everything in flight.
+    void drain(std::vector<io_completion>& out) {
+        wait(_in_flight, out);
+    }
+};
+
+class sync_io : public io_backend {
+    size_t _depth;
+    std::vector<io_completion> _done;
+public:
+    explicit sync_io(size_t depth) : _depth(depth) {
+        if (!depth) {
+            throw std::invalid_argument("I/O depth must be positive");
+        }
+        _done.reserve(depth);
+    }
+
+    virtual const char* name() const override {
+        return "sync";
+    }
+    virtual size_t depth() const override {
+        return _depth;
+    }
+    virtual void submit(const io_request& r) override {
+        ssize_t ret;
+        do {
+            ret = r.write ? ::pwrite(r.fd, r.buf, r.len, r.pos) : ::pread(r.fd, r.buf, r.len, r.pos);
+        } while (ret < 0 && errno == EINTR);
+        _done.push_back(io_completion{r.tag, ret < 0 ? -errno : ret});
+        _in_flight++;
+    }
+    virtual void wait(size_t, std::vector<io_completion>& out) override {
+        out.insert(out.end(), _done.begin(), _done.end());
+        _in_flight -= _done.size();
+        _done.clear();
+    }
+};
+
+class uring_io : public io_backend {
+    int _fd = -1;
+    unsigned _depth;
+    void* _sq_ring = MAP_FAILED;
+    size_t _sq_ring_len = 0;
+    void* _cq_ring = MAP_FAILED;
+    size_t _cq_ring_len = 0;
+    io_uring_sqe* _sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t _sqes_len = 0;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_mask;
+    unsigned* _sq_array;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned* _cq_mask;
+    io_uring_cqe* _cqes;
+    // queued in the ring, but not passed to the kernel yet.
+    unsigned _to_submit = 0;
+private:
+    [[noreturn]] static void fail(const char* what) {
+        throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+    }
+
+    static void* map_ring(int fd, size_t len, off_t offset) {
+        auto p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        if (p == MAP_FAILED) {
+            fail("io_uring mmap");
+        }
+        return p;
+    }
+
+    // IORING_OP_READ/WRITE came in 5.6, after io_uring itself (5.1); older
+    // kernels fail every such request with -EINVAL. So does the probe, which
+    // came with them.
+    bool supports_read_write() const {
+        std::vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe*>(buf.data());
+        if (::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+        auto supported = [&] (unsigned op) {
+            return op <= probe->last_op && op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        };
+        return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+    }
+
+    void release() {
+        if (_sqes != MAP_FAILED) {
+            ::munmap(_sqes, _sqes_len);
+        }
+        if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring) {
+            ::munmap(_cq_ring, _cq_ring_len);
+        }
+        if (_sq_ring != MAP_FAILED) {
+            ::munmap(_sq_ring, _sq_ring_len);
+        }
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    unsigned reap(std::vector<io_completion>& out) {
+        auto head = *_cq_head;
+        auto tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != tail; head++, n++) {
+            auto& cqe = _cqes[head & *_cq_mask];
+            out.push_back(io_completion{cqe.user_data, cqe.res});
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        _in_flight -= n;
+        return n;
+    }
+public:
+    // Throws if io_uring, or its read and write operations, isn't available.
+    explicit uring_io(unsigned depth) : _depth(depth) {
+        if (!depth) {
+            throw std::invalid_argument("I/O depth must be positive");
+        }
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        _fd = ::syscall(__NR_io_uring_setup, depth, &p);
+        if (_fd < 0) {
+            fail("io_uring_setup");
+        }
+        try {
+            if (!supports_read_write()) {
+                errno = EOPNOTSUPP;
+                fail("io_uring read/write");
+            }
+            _depth = p.sq_entries;
+            _sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            _cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                _sq_ring_len = _cq_ring_len = std::max(_sq_ring_len, _cq_ring_len);
+            }
+            _sq_ring = map_ring(_fd, _sq_ring_len, IORING_OFF_SQ_RING);
+            _cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? _sq_ring : map_ring(_fd, _cq_ring_len, IORING_OFF_CQ_RING);
+            _sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+            _sqes = static_cast<io_uring_sqe*>(map_ring(_fd, _sqes_len, IORING_OFF_SQES));
+        } catch (...) {
+            release();
+            throw;
+        }
+        auto sq = static_cast<char*>(_sq_ring);
+        _sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        _sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        auto cq = static_cast<char*>(_cq_ring);
+        _cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        _cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+    uring_io(const uring_io&) = delete;
+    void operator=(const uring_io&) = delete;
+    ~uring_io() {
+        release();
+    }
+
+    virtual const char* name() const override {
+        return "io_uring";
+    }
+    virtual size_t depth() const override {
+        return _depth;
+    }
+    virtual void submit(const io_request& r) override {
+        auto tail = *_sq_tail;
+        auto index = tail & *_sq_mask;
+        auto& sqe = _sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = r.fd;
+        sqe.addr = reinterpret_cast<uint64_t>(r.buf);
+        sqe.len = r.len;
+        sqe.off = r.pos;
+        sqe.user_data = r.tag;
+        _sq_array[index] = index;
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        _to_submit++;
+        _in_flight++;
+    }
+    virtual void wait(size_t min, std::vector<io_completion>& out) override {
+        size_t reaped = reap(out);
+        while (_to_submit || reaped < min) {
+            unsigned wanted = reaped < min ? min - reaped : 0;
+            auto ret = ::syscall(__NR_io_uring_enter, _fd, _to_submit, wanted, wanted ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    reaped += reap(out);
+                    continue;
+                }
+                fail("io_uring_enter");
+            }
+            _to_submit -= ret;
+            reaped += reap(out);
+        }
+    }
+};
+
+// io_uring if the kernel allows it, pread/pwrite otherwise.
+static inline std::unique_ptr<io_backend> make_io_backend(const std::string& name, unsigned depth) {
+    if (!depth) {
+        throw std::invalid_argument("I/O depth must be positive");
+    }
+    if (name == "sync") {
+        return std::make_unique<sync_io>(depth);
+    } else if (name == "uring") {
+        try {
+            return std::make_unique<uring_io>(depth);
+        } catch (const std::runtime_error&) {
+            return std::make_unique<sync_io>(depth);
+        }
+    }
+    throw std::runtime_error("unknown I/O backend: " + name);
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "temporary_buf.hh"
+
+// temporary_bufs backed by mmap instead of the heap: a read-only mapping of a
+// file, so that multi-GB inputs can be compressed in place without being
+// copied into memory first, writable mappings of output files, and anonymous
+// mappings for large outputs. Page faults and readahead then become part of
+// what's measured.
+
+enum class access_hint {
+    normal,
+    sequential,     // MADV_SEQUENTIAL: aggressive readahead, pages dropped behind
+    random,         // MADV_RANDOM: no readahead
+    willneed,       // MADV_WILLNEED: start reading the whole range now
+};
+
+namespace buf_alloc {
+
+static inline int madvise_flag(access_hint hint) {
+    switch (hint) {
+    case access_hint::sequential:
+        return MADV_SEQUENTIAL;
+    case access_hint::random:
+        return MADV_RANDOM;
+    case access_hint::willneed:
+        return MADV_WILLNEED;
+    default:
+        return MADV_NORMAL;
+    }
+}
+
+}
+
+static inline void advise(temporary_buf<char>& buf, access_hint hint) {
+    if (buf.size()) {
+        ::madvise(buf.get(), buf.size(), buf_alloc::madvise_flag(hint));
+    }
+}
+
+// Maps the file read-only. Writing to the buffer crashes.
+static inline temporary_buf<char> map_file(const std::string& path, access_hint hint = access_hint::normal) {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        auto err = errno;
+        ::close(fd);
+        throw std::runtime_error("cannot stat " + path + ": " + strerror(err));
+    }
+    size_t size = st.st_size;
+    if (!size) {
+        ::close(fd);
+        return temporary_buf<char>(nullptr, 0, buf_deleter());
+    }
+    auto p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path + ": " + strerror(err));
+    }
+    buf_deleter d;
+    d.free = buf_alloc::unmap;
+    auto buf = temporary_buf<char>(static_cast<char*>(p), size, d);
+    advise(buf, hint);
+    return buf;
+}
+
+// Zero-filled anonymous mapping, populated on first touch.
+static inline temporary_buf<char> map_anonymous(size_t size) {
+    if (!size) {
+        return temporary_buf<char>(nullptr, 0, buf_deleter());
+    }
+    auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    buf_deleter d;
+    d.free = buf_alloc::unmap;
+    return temporary_buf<char>(static_cast<char*>(p), size, d);
+}
+
+// Creates the file, or truncates it, with size bytes allocated with fallocate
+// (so that running out of space doesn't turn into SIGBUS on a page fault),
+// and maps it shared and writable: what's written to the buffer goes to the
+// page cache, and from there to the file, without going through a syscall.
+static inline temporary_buf<char> map_output_file(const std::string& path, size_t size) {
+    auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+    }
+    if (!size) {
+        ::close(fd);
+        return temporary_buf<char>(nullptr, 0, buf_deleter());
+    }
+    if (::fallocate(fd, 0, 0, size) < 0 && (errno != EOPNOTSUPP || ::ftruncate(fd, size) < 0)) {
+        auto err = errno;
+        ::close(fd);
+        throw std::runtime_error("cannot allocate " + path + ": " + strerror(err));
+    }
+    auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    auto err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path + ": " + strerror(err));
+    }
+    buf_deleter d;
+    d.free = buf_alloc::unmap;
+    return temporary_buf<char>(static_cast<char*>(p), size, d);
+}
+
+// Tells the kernel that [offset, offset + len) of a mapped buffer won't be
+// needed again (MADV_DONTNEED), so that streaming through a big file doesn't
+// keep it all resident. Only whole pages inside the range are dropped.
+static inline void release_consumed(temporary_buf<char>& buf, size_t offset, size_t len) {
+    auto start = buf_alloc::align_up(reinterpret_cast<uintptr_t>(buf.get()) + offset, alloc_policy::page_size);
+    auto end = (reinterpret_cast<uintptr_t>(buf.get()) + offset + len) & ~(alloc_policy::page_size - 1);
+    if (end > start) {
+        ::madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED);
+    }
+}
+
+// For a buffer consumed front to back in pieces that may be smaller than a
+// page, or not page aligned: drops the pages of [released, end) and moves
+// released to the last page boundary, so that the page straddling end goes
+// with the next piece rather than never.
+static inline void release_consumed_up_to(temporary_buf<char>& buf, size_t& released, size_t end) {
+    release_consumed(buf, released, end - released);
+    auto boundary = (reinterpret_cast<uintptr_t>(buf.get()) + end) & ~(alloc_policy::page_size - 1);
+    if (boundary > reinterpret_cast<uintptr_t>(buf.get()) + released) {
+        released = boundary - reinterpret_cast<uintptr_t>(buf.get());
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+// Marks the region of interest for an external profiler. With perf (>= 5.10):
+//
+//     mkfifo ctl ack
+//     perf record --delay=-1 --control=fifo:ctl,ack -g -- ./a.out ... --perf-ctl ctl --perf-ack ack
+//
+// perf then starts disabled and only samples between enable() and disable(),
+// so setup (data generation, compression of inputs) stays out of the profile.
+// Without fifos, enable() and disable() just print CLOCK_MONOTONIC timestamps,
+// which can be passed to perf script/report --time.
+class perf_control {
+    int _ctl_fd = -1;
+    int _ack_fd = -1;
+private:
+    static int open_fifo(const std::string& path, int flags) {
+        if (path.empty()) {
+            return -1;
+        }
+        auto fd = ::open(path.c_str(), flags);
+        if (fd < 0) {
+            throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+        }
+        return fd;
+    }
+
+    static double monotonic_seconds() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    void send(const char* cmd) {
+        if (_ctl_fd < 0) {
+            return;
+        }
+        if (::write(_ctl_fd, cmd, strlen(cmd)) < 0) {
+            throw std::runtime_error(std::string("perf control write failed: ") + strerror(errno));
+        }
+        if (_ack_fd >= 0) {
+            char ack[5];
+            if (::read(_ack_fd, ack, sizeof(ack)) < 0) {
+                throw std::runtime_error(std::string("perf control ack failed: ") + strerror(errno));
+            }
+        }
+    }
+public:
+    perf_control(const std::string& ctl_fifo, const std::string& ack_fifo)
+        : _ctl_fd(open_fifo(ctl_fifo, O_WRONLY)) {
+        // the destructor doesn't run if the constructor throws.
+        try {
+            _ack_fd = open_fifo(ack_fifo, O_RDONLY);
+        } catch (...) {
+            if (_ctl_fd >= 0) {
+                ::close(_ctl_fd);
+            }
+            throw;
+        }
+    }
+    perf_control(const perf_control&) = delete;
+    void operator=(const perf_control&) = delete;
+    ~perf_control() {
+        if (_ctl_fd >= 0) {
+            ::close(_ctl_fd);
+        }
+        if (_ack_fd >= 0) {
+            ::close(_ack_fd);
+        }
+    }
+
+    void enable() {
+        std::cout << boost::format("profile region start: %1$.9f") % monotonic_seconds() << std::endl;
+        send("enable\n");
+    }
+    void disable() {
+        send("disable\n");
+        std::cout << boost::format("profile region end: %1$.9f") % monotonic_seconds() << std::endl;
+    }
+};
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// A hardware event counter for the calling thread, counting user space only,
+// through perf_event_open(2). Counters are often unavailable (virtual machines,
+// perf_event_paranoid), in which case available() is false and read() is 0.
+class perf_counter {
+    int _fd = -1;
+public:
+    perf_counter(uint32_t type, uint64_t config) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    perf_counter(perf_counter&& other) : _fd(other._fd) {
+        other._fd = -1;
+    }
+    perf_counter(const perf_counter&) = delete;
+    void operator=(const perf_counter&) = delete;
+    ~perf_counter() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    static perf_counter dtlb_load_misses() {
+        return perf_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+
+    bool available() const {
+        return _fd >= 0;
+    }
+    void start() {
+        if (_fd >= 0) {
+            ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    void stop() {
+        if (_fd >= 0) {
+            ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    uint64_t read() const {
+        uint64_t v = 0;
+        if (_fd < 0 || ::read(_fd, &v, sizeof(v)) != sizeof(v)) {
+            return 0;
+        }
+        return v;
+    }
+};
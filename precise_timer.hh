@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+// Timer for operations that take about a microsecond, where reading
+// std::chrono clocks around a single call adds noticeable overhead and
+// quantization. It reads the TSC when the CPU has an invariant one (constant
+// rate, not stopped in deep C-states), serialized so that the measured code
+// can't be reordered across the reads, and falls back to steady_clock
+// otherwise. The TSC rate is calibrated against steady_clock at construction,
+// and the cost of an empty start()/stop() pair is measured and subtracted
+// from every measurement.
+class precise_timer {
+    bool _use_tsc = false;
+    double _ns_per_tick = 1.0;
+    uint64_t _overhead_ticks = 0;
+private:
+    static bool has_invariant_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+            return false;
+        }
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return edx & (1u << 8);
+#else
+        return false;
+#endif
+    }
+
+    static uint64_t steady_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void calibrate() {
+        static constexpr uint64_t calibration_ns = 50 * 1000 * 1000;
+        auto ns_start = steady_ns();
+        auto ticks_start = start();
+        uint64_t ns_end;
+        do {
+            ns_end = steady_ns();
+        } while (ns_end - ns_start < calibration_ns);
+        auto ticks_end = stop();
+        _ns_per_tick = double(ns_end - ns_start) / (ticks_end - ticks_start);
+    }
+
+    void measure_overhead() {
+        static constexpr int rounds = 10000;
+        uint64_t best = std::numeric_limits<uint64_t>::max();
+        for (auto i = 0; i < rounds; i++) {
+            auto s = start();
+            auto e = stop();
+            best = std::min(best, e - s);
+        }
+        _overhead_ticks = best;
+    }
+public:
+    precise_timer() : _use_tsc(has_invariant_tsc()) {
+        if (_use_tsc) {
+            calibrate();
+        }
+        measure_overhead();
+    }
+
+    // Both return ticks, to be converted with elapsed_ns().
+    uint64_t start() const {
+#if defined(__x86_64__) || defined(__i386__)
+        if (_use_tsc) {
+            _mm_lfence();
+            uint64_t t = __rdtsc();
+            _mm_lfence();
+            return t;
+        }
+#endif
+        return steady_ns();
+    }
+    uint64_t stop() const {
+#if defined(__x86_64__) || defined(__i386__)
+        if (_use_tsc) {
+            unsigned aux;
+            uint64_t t = __rdtscp(&aux);
+            _mm_lfence();
+            return t;
+        }
+#endif
+        return steady_ns();
+    }
+
+    uint64_t elapsed_ns(uint64_t start_ticks, uint64_t stop_ticks) const {
+        auto ticks = stop_ticks - start_ticks;
+        ticks = ticks > _overhead_ticks ? ticks - _overhead_ticks : 0;
+        return uint64_t(ticks * _ns_per_tick + 0.5);
+    }
+
+    // Runs func() and returns how long it took in nanoseconds.
+    template <typename Func>
+    uint64_t time(Func&& func) const {
+        auto s = start();
+        func();
+        return elapsed_ns(s, stop());
+    }
+
+    const char* source() const {
+        return _use_tsc ? "invariant TSC" : "steady_clock";
+    }
+    double ticks_per_ns() const {
+        return 1.0 / _ns_per_tick;
+    }
+    double overhead_ns() const {
+        return _overhead_ticks * _ns_per_tick;
+    }
+};
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+
+// Per-thread slab allocator for the few object sizes a library allocates over
+// and over, like zlib's stream state, window and hash tables (~6K to 64K each,
+// a handful per stream). Objects of a size class are carved out of slabs, and
+// freed objects go on an intrusive free list of the thread, so once warmed
+// up, allocating and freeing never reach the global allocator nor take a lock.
+//
+// Sizes are rounded up to a power of two, from 1K to 256K, so zlib's 64K
+// buffers take exactly 64K. Objects carry no header: slabs are aligned to
+// their size, and the size class is kept at the start of the slab, found by
+// masking the object's address. Bigger requests get a slab-aligned block of
+// their own from malloc. Memory is only given back to the system when the
+// thread exits, so objects must be freed on the thread that allocated them,
+// and before it exits.
+class slab_cache {
+    static constexpr unsigned min_class_shift = 10;
+    static constexpr unsigned max_class_shift = 18;
+    static constexpr unsigned nr_classes = max_class_shift - min_class_shift + 1;
+    static constexpr unsigned unslabbed = ~0u;
+    static constexpr size_t slab_size = 4 * 1024 * 1024;
+
+    // at the start of every slab. 64 bytes keep objects aligned like malloc's.
+    struct alignas(64) slab_header {
+        uint32_t size_class;
+        // of the single object of an unslabbed block.
+        size_t size;
+    };
+    struct free_object {
+        free_object* next;
+    };
+
+    std::array<free_object*, nr_classes> _free = {};
+    // objects not carved yet from the newest slab of each class.
+    std::array<char*, nr_classes> _carve = {};
+    std::array<char*, nr_classes> _carve_end = {};
+    std::vector<void*> _slabs;
+private:
+    static unsigned shift_of(size_t size) {
+        unsigned shift = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+        // not std::max(), which would odr-use the constant.
+        return shift < min_class_shift ? min_class_shift : shift;
+    }
+
+    static slab_header* header_of(void* p) {
+        return reinterpret_cast<slab_header*>(reinterpret_cast<uintptr_t>(p) & ~(slab_size - 1));
+    }
+
+    // nullptr if out of memory. Doesn't throw, as it's called from C libraries.
+    static slab_header* allocate_slab(size_t size, uint32_t size_class) {
+        void* p;
+        if (posix_memalign(&p, slab_size, size)) {
+            return nullptr;
+        }
+        auto h = static_cast<slab_header*>(p);
+        h->size_class = size_class;
+        return h;
+    }
+
+    bool refill(unsigned index) {
+        auto h = allocate_slab(slab_size, index);
+        if (!h) {
+            return false;
+        }
+        try {
+            _slabs.push_back(h);
+        } catch (...) {
+            ::free(h);
+            return false;
+        }
+        // objects are carved as needed, so untouched ones take no memory.
+        _carve[index] = reinterpret_cast<char*>(h + 1);
+        _carve_end[index] = reinterpret_cast<char*>(h) + slab_size;
+        return true;
+    }
+public:
+    slab_cache() = default;
+    slab_cache(const slab_cache&) = delete;
+    void operator=(const slab_cache&) = delete;
+    ~slab_cache() {
+        for (auto p : _slabs) {
+            ::free(p);
+        }
+    }
+
+    static slab_cache& local() {
+        static thread_local slab_cache c;
+        return c;
+    }
+
+    // nullptr if out of memory.
+    void* allocate(size_t size) {
+        auto shift = shift_of(size);
+        if (shift > max_class_shift) {
+            auto h = allocate_slab(sizeof(slab_header) + size, unslabbed);
+            if (!h) {
+                return nullptr;
+            }
+            h->size = size;
+            return h + 1;
+        }
+        auto index = shift - min_class_shift;
+        if (auto o = _free[index]) {
+            _free[index] = o->next;
+            return o;
+        }
+        auto object_size = size_t(1) << shift;
+        if (_carve_end[index] - _carve[index] < ptrdiff_t(object_size) && !refill(index)) {
+            return nullptr;
+        }
+        auto p = _carve[index];
+        _carve[index] += object_size;
+        return p;
+    }
+
+    void free(void* p) {
+        auto h = header_of(p);
+        if (h->size_class == unslabbed) {
+            ::free(h);
+            return;
+        }
+        auto o = static_cast<free_object*>(p);
+        o->next = _free[h->size_class];
+        _free[h->size_class] = o;
+    }
+
+    // bytes p takes: its size class, or the size of a bigger object.
+    static size_t size_of(void* p) {
+        auto h = header_of(p);
+        return h->size_class == unslabbed ? h->size : size_t(1) << (h->size_class + min_class_shift);
+    }
+};
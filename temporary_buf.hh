@@ -9,39 +9,350 @@
 
 #include <memory>
 #include <cstdlib>
+#include <cstddef>
 #include <ctime>
 #include <string.h>
 #include <algorithm>
+#include <stdexcept>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+enum class huge_pages {
+    no,
+    madvise,    // transparent huge pages, requested with madvise(MADV_HUGEPAGE)
+    hugetlb,    // reserved huge pages (MAP_HUGETLB), see /proc/sys/vm/nr_hugepages
+};
+
+// How the memory of a temporary_buf is allocated.
+struct alloc_policy {
+    static constexpr size_t cache_line_size = 64;
+    static constexpr size_t page_size = 4096;
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    size_t alignment = alignof(std::max_align_t);
+    huge_pages huge = huge_pages::no;
+
+    static alloc_policy heap() {
+        return alloc_policy();
+    }
+    static alloc_policy cache_line_aligned() {
+        alloc_policy p;
+        p.alignment = cache_line_size;
+        return p;
+    }
+    static alloc_policy page_aligned() {
+        alloc_policy p;
+        p.alignment = page_size;
+        return p;
+    }
+    static alloc_policy huge_page_aligned(huge_pages how = huge_pages::madvise) {
+        alloc_policy p;
+        p.alignment = huge_page_size;
+        p.huge = how;
+        return p;
+    }
+};
+
+// How the memory of a temporary_buf is given back when it's destroyed.
+struct buf_deleter {
+    void (*free)(void* p, size_t size, void* context) = nullptr;
+    void* context = nullptr;
+
+    void operator()(void* p, size_t size) const {
+        if (free) {
+            free(p, size, context);
+        }
+    }
+};
+
+// Constructs a temporary_buf without zeroing it, for buffers that are about to
+// be written over anyway, like codec outputs. Zeroing them would double the
+// memory traffic.
+struct uninitialized_t {};
+static constexpr uninitialized_t uninitialized{};
+
+namespace buf_alloc {
+
+static inline size_t align_up(size_t v, size_t alignment) {
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+static inline void free_heap(void* p, size_t, void*) {
+    ::free(p);
+}
+
+static inline void unmap(void* p, size_t size, void*) {
+    ::munmap(p, std::max<size_t>(size, 1));
+}
+
+static inline void free_mapping(void* p, size_t size, void*) {
+    ::munmap(p, align_up(std::max<size_t>(size, 1), alloc_policy::huge_page_size));
+}
+
+// Memory for huge pages comes straight from mmap: transparent huge pages need
+// a 2MB aligned range, so a bigger one is mapped and the excess unmapped.
+static inline void* map_huge(size_t size, huge_pages how) {
+    auto len = align_up(std::max<size_t>(size, 1), alloc_policy::huge_page_size);
+    if (how == huge_pages::hugetlb) {
+        auto p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("MAP_HUGETLB allocation failed, are huge pages reserved in /proc/sys/vm/nr_hugepages?");
+        }
+        return p;
+    }
+    auto map_len = len + alloc_policy::huge_page_size;
+    auto m = ::mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    auto start = reinterpret_cast<uintptr_t>(m);
+    auto aligned = align_up(start, alloc_policy::huge_page_size);
+    if (aligned > start) {
+        ::munmap(m, aligned - start);
+    }
+    if (start + map_len > aligned + len) {
+        ::munmap(reinterpret_cast<void*>(aligned + len), start + map_len - (aligned + len));
+    }
+    auto p = reinterpret_cast<void*>(aligned);
+    ::madvise(p, len, MADV_HUGEPAGE);
+    return p;
+}
+
+static inline void* allocate(size_t size, const alloc_policy& policy, buf_deleter& d) {
+    if (policy.huge != huge_pages::no) {
+        d.free = free_mapping;
+        return map_huge(size, policy.huge);
+    }
+    void* p;
+    if (posix_memalign(&p, std::max(policy.alignment, sizeof(void*)), std::max<size_t>(size, 1))) {
+        throw std::bad_alloc();
+    }
+    d.free = free_heap;
+    return p;
+}
+
+}
+
+// Source of memory for temporary_bufs, so that the allocation strategy (heap,
+// pool, arena, huge pages, NUMA node) is picked by the caller instead of being
+// hardcoded. Like std::pmr::memory_resource, except that allocate() also says
+// how the memory is given back, so freeing doesn't go through the resource.
+class buf_resource {
+public:
+    virtual ~buf_resource() {}
+    virtual void* allocate(size_t size, buf_deleter& d) = 0;
+};
+
+// Allocates according to an alloc_policy.
+class policy_resource : public buf_resource {
+    alloc_policy _policy;
+public:
+    explicit policy_resource(const alloc_policy& policy = alloc_policy::heap()) : _policy(policy) {}
+    void* allocate(size_t size, buf_deleter& d) override {
+        return buf_alloc::allocate(size, _policy, d);
+    }
+};
+
+static inline buf_resource& default_resource() {
+    static policy_resource r;
+    return r;
+}
+
+// Maps pages bound to a NUMA node, or to the node of the CPU that first
+// touches them with node = -1. mbind is called directly, as libnuma isn't
+// required; on kernels without NUMA support the binding is silently skipped.
+class numa_resource : public buf_resource {
+    static constexpr int mpol_bind = 2;     // MPOL_BIND
+    static constexpr int mpol_local = 4;    // MPOL_LOCAL
+    int _node;
+public:
+    explicit numa_resource(int node = -1) : _node(node) {
+        if (node >= 64) {
+            throw std::runtime_error("numa_resource supports nodes 0 to 63");
+        }
+    }
+    void* allocate(size_t size, buf_deleter& d) override {
+        auto len = std::max<size_t>(size, 1);
+        auto p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        unsigned long mask = _node < 0 ? 0 : 1UL << _node;
+        // maxnode is one more than the bits the kernel reads from the mask.
+        ::syscall(SYS_mbind, p, len, _node < 0 ? mpol_local : mpol_bind, _node < 0 ? nullptr : &mask,
+            sizeof(mask) * 8 + 1, 0);
+        d.free = buf_alloc::unmap;
+        return p;
+    }
+};
+
+// Places the end of every buffer against a PROT_NONE page, so that a decoder
+// writing (or reading) past the end faults right away instead of silently
+// corrupting memory. Buffers are only aligned as much as their size allows.
+//
+// Each buffer needs a mapping of its own, and mmap, mprotect and first-touch
+// faults cost microseconds, so mappings are prefaulted and, once released,
+// cached by length and reused: after warm-up, getting a buffer is a lock and
+// a free list pop. Up to max_cached_bytes of mappings are cached per length.
+class guard_page_resource : public buf_resource {
+    static constexpr size_t max_cached_bytes = 16 * 1024 * 1024;
+    static constexpr size_t min_cached_mappings = 16;
+
+    std::mutex _mutex;
+    // free mappings by length, guard page excluded.
+    std::unordered_map<size_t, std::vector<char*>> _free;
+private:
+    static size_t mapped_len(size_t size) {
+        return buf_alloc::align_up(std::max<size_t>(size, 1), alloc_policy::page_size);
+    }
+    static size_t max_cached(size_t len) {
+        auto n = max_cached_bytes / len;
+        return n < min_cached_mappings ? min_cached_mappings : n;
+    }
+    static char* map(size_t len) {
+        auto m = ::mmap(nullptr, len + alloc_policy::page_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (m == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        auto base = static_cast<char*>(m);
+        if (::mprotect(base + len, alloc_policy::page_size, PROT_NONE) < 0) {
+            ::munmap(m, len + alloc_policy::page_size);
+            throw std::bad_alloc();
+        }
+        return base;
+    }
+    static void release(void* p, size_t size, void* context) {
+        auto& r = *static_cast<guard_page_resource*>(context);
+        auto len = mapped_len(size);
+        auto base = static_cast<char*>(p) + size - len;
+        try {
+            std::lock_guard<std::mutex> lock(r._mutex);
+            auto& list = r._free[len];
+            if (list.size() < max_cached(len)) {
+                list.push_back(base);
+                return;
+            }
+        } catch (...) {
+            // out of memory for the free list: unmap instead.
+        }
+        ::munmap(base, len + alloc_policy::page_size);
+    }
+public:
+    guard_page_resource() = default;
+    guard_page_resource(const guard_page_resource&) = delete;
+    void operator=(const guard_page_resource&) = delete;
+    // buffers must be released before the resource is destroyed.
+    ~guard_page_resource() {
+        for (auto& list : _free) {
+            for (auto base : list.second) {
+                ::munmap(base, list.first + alloc_policy::page_size);
+            }
+        }
+    }
+
+    void* allocate(size_t size, buf_deleter& d) override {
+        auto len = mapped_len(size);
+        char* base = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _free.find(len);
+            if (it != _free.end() && !it->second.empty()) {
+                base = it->second.back();
+                it->second.pop_back();
+            }
+        }
+        if (!base) {
+            base = map(len);
+        }
+        d.free = release;
+        d.context = this;
+        return base + len - size;
+    }
+};
 
 template <typename T>
 class temporary_buf {
     static_assert(sizeof(T) == 1, "must be stream of bytes");
     T* _p;
     size_t _s;
+    // size the memory was allocated with, which trim() doesn't change.
+    size_t _capacity;
+    buf_deleter _deleter;
+    // how buffers derived from this one (copies, operator+) are allocated:
+    // from _resource if there's one, or else with _policy.
+    alloc_policy _policy;
+    buf_resource* _resource = nullptr;
+private:
+    static void delete_array(void* p, size_t, void*) {
+        delete[] static_cast<T*>(p);
+    }
 public:
-    temporary_buf(size_t s)
-        : _p(new T[s])
-        , _s(s) {
+    temporary_buf(size_t s, uninitialized_t, const alloc_policy& policy = alloc_policy::heap())
+        : _s(s)
+        , _capacity(s)
+        , _policy(policy) {
+        _p = static_cast<T*>(buf_alloc::allocate(s, policy, _deleter));
+    }
+    temporary_buf(size_t s, const alloc_policy& policy = alloc_policy::heap())
+        : temporary_buf(s, uninitialized, policy) {
         memset(_p, 0, s);
     }
+    temporary_buf(size_t s, uninitialized_t, buf_resource& r)
+        : _s(s)
+        , _capacity(s)
+        , _resource(&r) {
+        _p = static_cast<T*>(r.allocate(s, _deleter));
+    }
+    temporary_buf(size_t s, buf_resource& r)
+        : temporary_buf(s, uninitialized, r) {
+        memset(_p, 0, s);
+    }
+    // allocated the same way as like: same resource, or same policy.
+    temporary_buf(size_t s, uninitialized_t, const temporary_buf<T>& like)
+        : _s(s)
+        , _capacity(s)
+        , _policy(like._policy)
+        , _resource(like._resource) {
+        _p = static_cast<T*>(_resource ? _resource->allocate(s, _deleter) : buf_alloc::allocate(s, _policy, _deleter));
+    }
+    // takes ownership of p, which must have been allocated with new T[].
     temporary_buf(T* p, size_t s)
         : _p(p)
-        , _s(s) {
+        , _s(s)
+        , _capacity(s) {
+        _deleter.free = delete_array;
     }
-    temporary_buf(const temporary_buf<T>& other) {
-        size_t s = other.size();
-        T* buf = new T[s];
-        memcpy(buf, other.get(), s);
-        _p = buf;
-        _s = s;
+    // takes ownership of p, which will be given back through d. r is the
+    // resource p came from, if any.
+    temporary_buf(T* p, size_t s, buf_deleter d, buf_resource* r = nullptr)
+        : _p(p)
+        , _s(s)
+        , _capacity(s)
+        , _deleter(d)
+        , _resource(r) {
+    }
+    temporary_buf(const temporary_buf<T>& other) : temporary_buf(other.size(), uninitialized, other) {
+        memcpy(_p, other.get(), _s);
     }
-    temporary_buf(temporary_buf<T>&& other) : _p(other._p), _s(other._s) {
+    temporary_buf(temporary_buf<T>&& other)
+        : _p(other._p)
+        , _s(other._s)
+        , _capacity(other._capacity)
+        , _deleter(other._deleter)
+        , _policy(other._policy)
+        , _resource(other._resource) {
         other._p = nullptr;
         other._s = 0;
+        other._capacity = 0;
     }
     ~temporary_buf() {
         if (_p) {
-            delete _p;
+            _deleter(_p, _capacity);
         }
     }
 
@@ -54,6 +365,11 @@ public:
     size_t size() const {
         return _s;
     }
+    // buffers allocated with an alloc_policy report the default resource,
+    // though copies of them keep the policy.
+    buf_resource& resource() const {
+        return _resource ? *_resource : default_resource();
+    }
     void trim(size_t pos) {
         _s = pos;
     }
@@ -63,20 +379,31 @@ public:
     }
     void operator=(const temporary_buf<T>&) = delete;
 
-    static temporary_buf<T> random(size_t s) {
-        T* buf = new T[s];
+    static temporary_buf<T> random(size_t s, const alloc_policy& policy = alloc_policy::heap()) {
+        auto buf = temporary_buf<T>(s, uninitialized, policy);
+        buf.fill_random();
+        return buf;
+    }
+    static temporary_buf<T> random(size_t s, buf_resource& r) {
+        auto buf = temporary_buf<T>(s, uninitialized, r);
+        buf.fill_random();
+        return buf;
+    }
+private:
+    void fill_random() {
         std::srand(std::time(0));
-        for (auto i = 0; i < s; i++) {
-            buf[i] = std::rand();
+        for (auto i = 0; i < _s; i++) {
+            _p[i] = std::rand();
         }
-        return temporary_buf<T>(buf, s);
     }
 };
 
+// Copies both buffers into a new one, allocated like a. chained_buf
+// concatenates without copying.
 template <typename T>
 static temporary_buf<T> operator+(const temporary_buf<T>& a, const temporary_buf<T>& b) {
-    T* buf = new T[a.size() + b.size()];
-    memcpy(buf, a.get(), a.size());
-    memcpy(buf + a.size(), b.get(), b.size());
-    return temporary_buf<T>(buf, a.size() + b.size());
+    auto buf = temporary_buf<T>(a.size() + b.size(), uninitialized, a);
+    memcpy(buf.get(), a.get(), a.size());
+    memcpy(buf.get() + a.size(), b.get(), b.size());
+    return buf;
 }
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/optional.hpp>
+#include <boost/format.hpp>
+
+// Trace of compression operations, as recorded in production, one per line:
+//
+//     <timestamp_us> <op> <size> [<data_offset>]
+//
+// timestamp_us is the arrival time in microseconds (any origin, non-decreasing),
+// op is either "compress" or "uncompress", size is the uncompressed length of
+// the chunk, and data_offset optionally says where in the corpus the chunk's
+// contents come from. Empty lines and lines starting with '#' are ignored.
+
+enum class trace_op {
+    compress,
+    uncompress,
+};
+
+struct trace_record {
+    uint64_t timestamp_us;
+    trace_op op;
+    size_t size;
+    boost::optional<uint64_t> data_offset;
+};
+
+static inline std::vector<trace_record> load_trace(const std::string& path) {
+    std::ifstream f(path);
+    if (!f) {
+        throw std::runtime_error("cannot open trace " + path);
+    }
+
+    std::vector<trace_record> records;
+    std::string line;
+    for (size_t line_nr = 1; std::getline(f, line); line_nr++) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream in(line);
+        trace_record r;
+        std::string op;
+        uint64_t offset;
+        if (!(in >> r.timestamp_us >> op >> r.size) || !r.size) {
+            throw std::runtime_error((boost::format("%1%:%2%: malformed trace record") % path % line_nr).str());
+        }
+        if (op == "compress") {
+            r.op = trace_op::compress;
+        } else if (op == "uncompress") {
+            r.op = trace_op::uncompress;
+        } else {
+            throw std::runtime_error((boost::format("%1%:%2%: unknown operation %3%") % path % line_nr % op).str());
+        }
+        if (in >> offset) {
+            r.data_offset = offset;
+        }
+        if (!records.empty() && r.timestamp_us < records.back().timestamp_us) {
+            throw std::runtime_error((boost::format("%1%:%2%: timestamp goes backwards") % path % line_nr).str());
+        }
+        records.push_back(r);
+    }
+    return records;
+}